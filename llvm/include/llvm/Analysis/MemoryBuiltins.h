@@ -93,6 +93,33 @@ bool isReallocLikeFn(const Value *V, const TargetLibraryInfo *TLI,
 /// reallocates memory (e.g., realloc).
 bool isReallocLikeFn(const Function *F, const TargetLibraryInfo *TLI);
 
+//===----------------------------------------------------------------------===//
+//  Custom allocation functions.
+//
+
+/// Describes an allocation function that TargetLibraryInfo doesn't know about,
+/// e.g. the allocator of a garbage collected runtime.
+struct CustomAllocFnInfo {
+  /// Number of parameters of the function.
+  unsigned NumParams;
+  /// Index of the parameter holding the allocation size in bytes.
+  unsigned SizeParam;
+  /// True if the returned memory is zero-filled (calloc-like).
+  bool ZeroInit;
+  /// True if the function may return null.
+  bool MayReturnNull;
+};
+
+/// Registers \p Name as an allocation function, so that the queries in this
+/// file treat calls to it like calls to malloc, or calloc if it returns zeroed
+/// memory. Registering a name again replaces its description. This is not
+/// thread-safe and should be done before any pass runs.
+void registerCustomAllocationFn(StringRef Name, const CustomAllocFnInfo &Info);
+
+/// Returns the description of the custom allocation function \p Name, or null
+/// if it wasn't registered.
+const CustomAllocFnInfo *getCustomAllocationFnInfo(StringRef Name);
+
 //===----------------------------------------------------------------------===//
 //  malloc Call Utility Functions.
 //
@@ -17,6 +17,7 @@
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/TargetFolder.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
@@ -38,6 +39,7 @@
 #include "llvm/IR/Value.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include <cassert>
@@ -108,6 +110,37 @@ static const std::pair<LibFunc, AllocFnsTy> AllocationFnData[] = {
   // TODO: Handle "int posix_memalign(void **, size_t, size_t)"
 };
 
+static ManagedStatic<StringMap<CustomAllocFnInfo>> CustomAllocationFns;
+
+void llvm::registerCustomAllocationFn(StringRef Name,
+                                      const CustomAllocFnInfo &Info) {
+  (*CustomAllocationFns)[Name] = Info;
+}
+
+const CustomAllocFnInfo *llvm::getCustomAllocationFnInfo(StringRef Name) {
+  auto It = CustomAllocationFns->find(Name);
+  if (It == CustomAllocationFns->end())
+    return nullptr;
+  return &It->second;
+}
+
+/// Returns the allocation data of a registered custom allocation function.
+static Optional<AllocFnsTy> getCustomAllocationData(StringRef FnName) {
+  const CustomAllocFnInfo *Info = getCustomAllocationFnInfo(FnName);
+  if (!Info)
+    return None;
+
+  AllocFnsTy FnData;
+  if (Info->ZeroInit)
+    FnData.AllocTy = CallocLike;
+  else
+    FnData.AllocTy = Info->MayReturnNull ? MallocLike : OpNewLike;
+  FnData.NumParams = Info->NumParams;
+  FnData.FstParam = Info->SizeParam;
+  FnData.SndParam = -1;
+  return FnData;
+}
+
 static const Function *getCalledFunction(const Value *V, bool LookThroughBitCast,
                                          bool &IsNoBuiltin) {
   // Don't care about intrinsics in this case.
@@ -134,21 +167,25 @@ static const Function *getCalledFunction(const Value *V, bool LookThroughBitCast
 static Optional<AllocFnsTy>
 getAllocationDataForFunction(const Function *Callee, AllocType AllocTy,
                              const TargetLibraryInfo *TLI) {
-  // Make sure that the function is available.
   StringRef FnName = Callee->getName();
-  LibFunc TLIFn;
-  if (!TLI || !TLI->getLibFunc(FnName, TLIFn) || !TLI->has(TLIFn))
-    return None;
-
-  const auto *Iter = find_if(
-      AllocationFnData, [TLIFn](const std::pair<LibFunc, AllocFnsTy> &P) {
-        return P.first == TLIFn;
-      });
-
-  if (Iter == std::end(AllocationFnData))
-    return None;
+  Optional<AllocFnsTy> Data = getCustomAllocationData(FnName);
+  if (!Data) {
+    // Make sure that the function is available.
+    LibFunc TLIFn;
+    if (!TLI || !TLI->getLibFunc(FnName, TLIFn) || !TLI->has(TLIFn))
+      return None;
+
+    const auto *Iter = find_if(
+        AllocationFnData, [TLIFn](const std::pair<LibFunc, AllocFnsTy> &P) {
+          return P.first == TLIFn;
+        });
+
+    if (Iter == std::end(AllocationFnData))
+      return None;
+    Data = Iter->second;
+  }
 
-  const AllocFnsTy *FnData = &Iter->second;
+  const AllocFnsTy *FnData = Data.getPointer();
   if ((FnData->AllocTy & AllocTy) != FnData->AllocTy)
     return None;
 
@@ -0,0 +1,89 @@
+#ifndef LLVM_LIB_CODEGEN_SAFEC_ESCAPETRACKER_H
+#define LLVM_LIB_CODEGEN_SAFEC_ESCAPETRACKER_H
+
+#include "llvm/Analysis/CaptureTracking.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+namespace safec {
+
+using namespace llvm;
+
+inline bool isLibraryCall(const CallInst *CI, const TargetLibraryInfo *TLI)
+{
+	LibFunc Func;
+	if (TLI->getLibFunc(ImmutableCallSite(CI), Func)) {
+		return true;
+	}
+	auto Callee = CI->getCalledFunction();
+	if (Callee && (Callee->getName() == "readArgv"
+			|| Callee->getName() == "WriteBarrier"
+			|| Callee->getName() == "WriteBarrierWithSize")) {
+		return true;
+	}
+	if (isa<IntrinsicInst>(CI)) {
+		return true;
+	}
+	return false;
+}
+
+/* A pointer escapes if it is captured, or if it is passed to
+ * a function that is not a library call: such a callee would
+ * get the address without the object metadata the checks need.
+ * Captured is set when the address may outlive the uses seen
+ * here, i.e. unless every escape is a nocapture argument.
+ * Comparisons against null don't leak the address.
+ */
+struct EscapeTracker : public CaptureTracker {
+	const TargetLibraryInfo *TLI;
+	bool Escapes = false;
+	bool Captured = false;
+
+	EscapeTracker(const TargetLibraryInfo *TLI) : TLI(TLI) {}
+
+	void tooManyUses() override { Escapes = Captured = true; }
+
+	bool shouldExplore(const Use *U) override {
+		auto *CI = dyn_cast<CallInst>(U->getUser());
+		if (CI && CI->isArgOperand(U) && !isLibraryCall(CI, TLI)) {
+			Escapes = true;
+			if (!CI->doesNotCapture(CI->getDataOperandNo(U))) {
+				Captured = true;
+			}
+			return false;
+		}
+		auto *Cmp = dyn_cast<ICmpInst>(U->getUser());
+		if (Cmp && (isa<ConstantPointerNull>(Cmp->getOperand(0))
+				|| isa<ConstantPointerNull>(Cmp->getOperand(1)))) {
+			return false;
+		}
+		return true;
+	}
+
+	bool captured(const Use *U) override {
+		Escapes = Captured = true;
+		return true;
+	}
+};
+
+/* number of uses explored per pointer before we give up
+ * and treat it as escaping */
+static const unsigned MaxUsesToExplore = 256;
+
+inline bool isEscaping(const Value *V, const TargetLibraryInfo *TLI,
+		bool *Captured = nullptr)
+{
+	EscapeTracker Tracker(TLI);
+	PointerMayBeCaptured(V, &Tracker, MaxUsesToExplore);
+	if (Captured) {
+		*Captured = Tracker.Captured;
+	}
+	return Tracker.Escapes;
+}
+
+} // end of namespace safec
+
+#endif
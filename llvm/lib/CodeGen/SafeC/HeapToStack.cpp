@@ -0,0 +1,212 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Use.h"
+#include "llvm/IR/User.h"
+#include "llvm/IR/Value.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include "EscapeTracker.h"
+#include "objheader.h"
+
+using namespace llvm;
+using namespace safec;
+
+static const uint64_t ObjHeaderSize = OBJ_HEADER_SIZE;
+
+/* largest mymalloc request that is moved to the stack */
+static const uint64_t MaxStackObjectSize = 1024;
+
+namespace {
+/* Rewrites constant-size mymalloc calls whose result never escapes
+ * the function into allocas. The alloca carries a zeroed object
+ * header in front of the object, so runtime checks that read the
+ * header still work. When nothing reads the header, SROA (run after
+ * this pass) splits the object into SSA values.
+ */
+struct HeapToStack : public FunctionPass {
+  static char ID;
+	const TargetLibraryInfo *TLI = nullptr;
+  HeapToStack() : FunctionPass(ID) {}
+
+	void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<TargetLibraryInfoWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+  }
+
+  bool runOnFunction(Function &F) override;
+
+private:
+	bool isStackAllocatable(CallInst *CI, LoopInfo &LI);
+	void removeWriteBarriers(CallInst *CI);
+	void findInitializedBytes(CallInst *CI, BitVector &Initialized);
+	void convertToAlloca(CallInst *CI);
+
+}; // end of struct HeapToStack
+}  // end of anonymous namespace
+
+static bool isMyMallocCall(CallInst *CI)
+{
+	if (!CI->getCalledValue()) {
+		return false;
+	}
+	auto *Callee = CI->getCalledValue()->stripPointerCasts();
+	return Callee->getName() == "mymalloc";
+}
+
+bool HeapToStack::isStackAllocatable(CallInst *CI, LoopInfo &LI)
+{
+	auto *Size = dyn_cast<ConstantInt>(CI->getArgOperand(0));
+	if (!Size || Size->isZero() || Size->getZExtValue() > MaxStackObjectSize) {
+		return false;
+	}
+	/* a single alloca can't stand in for one object per iteration */
+	if (LI.getLoopFor(CI->getParent())) {
+		return false;
+	}
+	return !isEscaping(CI, TLI);
+}
+
+static bool isWriteBarrierCall(Instruction *I)
+{
+	auto *CI = dyn_cast<CallInst>(I);
+	if (!CI || !CI->getCalledFunction()) {
+		return false;
+	}
+	StringRef Name = CI->getCalledFunction()->getName();
+	return Name == "WriteBarrier" || Name == "WriteBarrierWithSize";
+}
+
+/* Like the other stack slots, the object is rescanned in the
+ * final pause of a concurrent mark and needs no write barrier. */
+void HeapToStack::removeWriteBarriers(CallInst *CI)
+{
+	SmallVector<CallInst*, 8> Barriers;
+	for (User *U : CI->users()) {
+		auto *Barrier = dyn_cast<CallInst>(U);
+		if (Barrier && isWriteBarrierCall(Barrier)
+				&& Barrier->getArgOperand(0)->stripPointerCasts() == CI) {
+			Barriers.push_back(Barrier);
+		}
+	}
+	for (CallInst *Barrier : Barriers) {
+		Barrier->eraseFromParent();
+	}
+}
+
+/* Marks the bytes of the object that the block stores to, at
+ * constant offsets, before anything may read the object: those
+ * don't have to be zeroed. The barriers left are those of other
+ * objects, which can't read this one as it doesn't escape.
+ */
+void HeapToStack::findInitializedBytes(CallInst *CI, BitVector &Initialized)
+{
+	const DataLayout &DL = CI->getModule()->getDataLayout();
+	uint64_t Size = Initialized.size() - ObjHeaderSize;
+
+	for (auto It = std::next(CI->getIterator()); !It->isTerminator(); ++It) {
+		Instruction *I = &*It;
+		if (auto *SI = dyn_cast<StoreInst>(I)) {
+			int64_t Offset;
+			Value *Ptr = GetPointerBaseWithConstantOffset(SI->getPointerOperand(),
+				Offset, DL);
+			uint64_t StoreSize = DL.getTypeStoreSize(SI->getValueOperand()->getType());
+			if (Ptr == CI && Offset >= 0 && Offset + StoreSize <= Size) {
+				Initialized.set(ObjHeaderSize + Offset,
+					ObjHeaderSize + Offset + StoreSize);
+			}
+			continue;
+		}
+		if (isWriteBarrierCall(I) || isa<DbgInfoIntrinsic>(I)) {
+			continue;
+		}
+		if (isa<CallInst>(I) || I->mayReadFromMemory()) {
+			break;
+		}
+	}
+}
+
+void HeapToStack::convertToAlloca(CallInst *CI)
+{
+	Function *F = CI->getFunction();
+	uint64_t Size = cast<ConstantInt>(CI->getArgOperand(0))->getZExtValue();
+	uint64_t AlignedSize = alignTo(Size, 8) + ObjHeaderSize;
+
+	IRBuilder<> EntryIRB(&*F->getEntryBlock().getFirstInsertionPt());
+	auto ObjTy = ArrayType::get(EntryIRB.getInt8Ty(), AlignedSize);
+	AllocaInst *AI = EntryIRB.CreateAlloca(ObjTy, nullptr, "stackobj");
+	AI->setAlignment(16);
+
+	removeWriteBarriers(CI);
+
+	/* mymalloc returns zeroed memory, so does the stack object,
+	 * except for the bytes stored to before they can be read */
+	BitVector Initialized(AlignedSize);
+	findInitializedBytes(CI, Initialized);
+
+	IRBuilder<> IRB(CI);
+	int Start = Initialized.find_first_unset();
+	while (Start != -1) {
+		int End = Initialized.find_next(Start);
+		if (End == -1) {
+			End = AlignedSize;
+		}
+		Value *Ptr = IRB.CreateConstInBoundsGEP2_64(AI, 0, Start);
+		IRB.CreateMemSet(Ptr, IRB.getInt8(0), End - Start, MinAlign(16, Start));
+		Start = (uint64_t)End < AlignedSize ? Initialized.find_next_unset(End) : -1;
+	}
+	Value *Header = IRB.CreateConstInBoundsGEP2_64(AI, 0, 0);
+	Type *SizeTy = IRB.getIntNTy(sizeof(ObjHeader::Size) * 8);
+	Value *SizeField = IRB.CreateBitCast(Header, SizeTy->getPointerTo());
+	IRB.CreateStore(ConstantInt::get(SizeTy, AlignedSize), SizeField);
+
+	Value *Obj = IRB.CreateConstInBoundsGEP2_64(AI, 0, ObjHeaderSize);
+	Obj = IRB.CreatePointerCast(Obj, CI->getType());
+	CI->replaceAllUsesWith(Obj);
+	CI->eraseFromParent();
+}
+
+bool HeapToStack::runOnFunction(Function &F) {
+	TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+	LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+	SmallVector<CallInst*, 8> StackAllocs;
+
+	for (Instruction &I : instructions(F)) {
+		auto *CI = dyn_cast<CallInst>(&I);
+		if (CI && isMyMallocCall(CI) && isStackAllocatable(CI, LI)) {
+			StackAllocs.push_back(CI);
+		}
+	}
+
+	for (CallInst *CI : StackAllocs) {
+		convertToAlloca(CI);
+	}
+	return !StackAllocs.empty();
+}
+
+char HeapToStack::ID = 0;
+static RegisterPass<HeapToStack> X("heaptostack", "Heap to Stack Pass",
+                                   false /* Only looks at CFG */,
+                                   false /* Analysis Pass */);
+
+static RegisterStandardPasses Y(
+    PassManagerBuilder::EP_EarlyAsPossible,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) { PM.add(new HeapToStack()); });
@@ -18,14 +18,19 @@
 #include "llvm/CodeGen/Analysis.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/MemoryBuiltins.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Support/LowLevelTypeImpl.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
+#include "EscapeTracker.h"
+
 #include <deque>
 
 using namespace llvm;
+using namespace safec;
 
 namespace {
 struct MemSafe : public FunctionPass {
@@ -37,30 +42,236 @@ struct MemSafe : public FunctionPass {
     AU.addRequired<TargetLibraryInfoWrapperPass>();
   }
 
+  bool doInitialization(Module &M) override;
   bool runOnFunction(Function &F) override;
 
+private:
+	void promoteToHeap(AllocaInst *AI, bool Captured,
+		ArrayRef<ReturnInst*> Returns);
+	void addWriteBarrier(Instruction *I, Value *Ptr, Value *Size);
+
 }; // end of struct MemSafe
 }  // end of anonymous namespace
 
-static bool isLibraryCall(const CallInst *CI, const TargetLibraryInfo *TLI)
+/* mymalloc returns fresh, zero-filled memory and never returns
+ * null (it exits when out of memory). */
+static const CustomAllocFnInfo MyMallocInfo = {
+	/* NumParams */ 1, /* SizeParam */ 0,
+	/* ZeroInit */ true, /* MayReturnNull */ false
+};
+
+/* alignment of the pointers returned by mymalloc */
+static const unsigned MyMallocAlignment = 8;
+
+static void setAllocatorAttributes(Function *F)
 {
-	LibFunc Func;
-	if (TLI->getLibFunc(ImmutableCallSite(CI), Func)) {
-		return true;
+	LLVMContext &C = F->getContext();
+	F->addAttribute(AttributeList::ReturnIndex, Attribute::NoAlias);
+	F->addAttribute(AttributeList::ReturnIndex, Attribute::NonNull);
+	F->addAttribute(AttributeList::ReturnIndex,
+		Attribute::getWithAlignment(C, MyMallocAlignment));
+	F->addAttribute(AttributeList::FunctionIndex,
+		Attribute::getWithAllocSizeArgs(C, MyMallocInfo.SizeParam, None));
+}
+
+/* Let MemoryBuiltins know that mymalloc is an allocation function,
+ * so that the standard optimizations (dead allocation removal,
+ * objectsize, noalias-based GVN/LICM and DSE) apply to GC objects.
+ * The registry lives in the opt process, so the registration runs
+ * when the plugin is loaded: the passes scheduled in the same opt
+ * invocation see it, the clang -O3 run before us doesn't.
+ */
+static struct RegisterMyMalloc {
+	RegisterMyMalloc() { registerCustomAllocationFn("mymalloc", MyMallocInfo); }
+} MyMallocRegistration;
+
+/* Tells SafeGC that the program has write barriers, which its
+ * concurrent and generational modes need. Every instrumented
+ * module defines the flag; the linker keeps one of them. */
+static void defineBarrierFlag(Module &M)
+{
+	Type *Int32Ty = Type::getInt32Ty(M.getContext());
+	auto *Flag = dyn_cast<GlobalVariable>(
+		M.getOrInsertGlobal("SafeGCWriteBarriers", Int32Ty));
+	if (Flag && Flag->isDeclaration()) {
+		Flag->setInitializer(ConstantInt::get(Int32Ty, 1));
+		Flag->setLinkage(GlobalValue::WeakAnyLinkage);
+	}
+}
+
+bool MemSafe::doInitialization(Module &M) {
+	defineBarrierFlag(M);
+	if (Function *F = M.getFunction("mymalloc")) {
+		setAllocatorAttributes(F);
 	}
-	auto Callee = CI->getCalledFunction();
-	if (Callee && Callee->getName() == "readArgv") {
-		return true;
+	return true;
+}
+
+static void removeLifetimeMarkers(AllocaInst *AI)
+{
+	SmallVector<Instruction*, 4> Markers;
+
+	for (User *U : AI->users()) {
+		auto *I = cast<Instruction>(U);
+		if (I->isLifetimeStartOrEnd()) {
+			Markers.push_back(I);
+		}
+		else if (isa<BitCastInst>(I)) {
+			for (User *BU : I->users()) {
+				if (cast<Instruction>(BU)->isLifetimeStartOrEnd()) {
+					Markers.push_back(cast<Instruction>(BU));
+				}
+			}
+		}
 	}
-	if (isa<IntrinsicInst>(CI)) {
-		return true;
+	for (Instruction *I : Markers) {
+		I->eraseFromParent();
 	}
-	return false;
+}
+
+/* Replace an escaping alloca with a GC allocation. A static
+ * alloca that is only passed to nocapture arguments dominates
+ * every return and is dead once the frame exits, so its object
+ * is released there; captured and dynamic ones are left to the
+ * collector. mymalloc only aligns to 8 bytes: stricter locals
+ * get padding and an aligned address inside the object.
+ */
+void MemSafe::promoteToHeap(AllocaInst *AI, bool Captured,
+	ArrayRef<ReturnInst*> Returns)
+{
+	Function *F = AI->getFunction();
+	Module *M = F->getParent();
+	const DataLayout &DL = M->getDataLayout();
+	IRBuilder<> IRB(AI);
+	auto Int64Ty = IRB.getInt64Ty();
+	auto Int8PtrTy = IRB.getInt8PtrTy();
+
+	Value *Size = ConstantInt::get(Int64Ty, DL.getTypeAllocSize(AI->getAllocatedType()));
+	if (AI->isArrayAllocation()) {
+		Value *Count = IRB.CreateZExtOrTrunc(AI->getArraySize(), Int64Ty);
+		Size = IRB.CreateMul(Count, Size);
+	}
+
+	auto MallocFn = M->getOrInsertFunction("mymalloc", Int8PtrTy, Int64Ty);
+	if (auto *MallocDecl = dyn_cast<Function>(MallocFn.getCallee())) {
+		setAllocatorAttributes(MallocDecl);
+	}
+	unsigned Alignment = AI->getAlignment();
+	if (Alignment == 0) {
+		Alignment = DL.getPrefTypeAlignment(AI->getAllocatedType());
+	}
+	if (Alignment > MyMallocAlignment) {
+		Size = IRB.CreateAdd(Size,
+			ConstantInt::get(Int64Ty, Alignment - MyMallocAlignment));
+	}
+	Value *Obj = IRB.CreateCall(MallocFn, {Size});
+	Value *Base = Obj;
+	if (Alignment > MyMallocAlignment) {
+		auto AlignFn = M->getOrInsertFunction("GetAlignedAddr", Int8PtrTy,
+			Int8PtrTy, Int64Ty);
+		Base = IRB.CreateCall(AlignFn, {Obj, ConstantInt::get(Int64Ty, Alignment)});
+	}
+	Value *Ptr = IRB.CreatePointerCast(Base, AI->getType());
+
+	bool IsStatic = AI->isStaticAlloca();
+	removeLifetimeMarkers(AI);
+	AI->replaceAllUsesWith(Ptr);
+	Ptr->takeName(AI);
+	AI->eraseFromParent();
+
+	if (!IsStatic || Captured) {
+		return;
+	}
+	auto FreeFn = M->getOrInsertFunction("myfree", IRB.getVoidTy(), Int8PtrTy);
+	for (ReturnInst *RI : Returns) {
+		IRBuilder<> ExitIRB(RI);
+		ExitIRB.CreateCall(FreeFn, {Obj});
+	}
+}
+
+/* Call WriteBarrier(Base, Ptr, Size) before a store that may
+ * overwrite a pointer in the heap; the runtime logs the old
+ * value while the collector marks concurrently. Stack slots and
+ * globals are rescanned in the final pause and need no barrier.
+ * The WriteBarriers pass later guards the call with an inline
+ * test of the collector flags.
+ */
+void MemSafe::addWriteBarrier(Instruction *I, Value *Ptr, Value *Size)
+{
+	Module *M = I->getModule();
+	const DataLayout &DL = M->getDataLayout();
+	Value *Base = GetUnderlyingObject(Ptr, DL, 0);
+	if (isa<AllocaInst>(Base) || isa<GlobalVariable>(Base)) {
+		return;
+	}
+
+	IRBuilder<> IRB(I);
+	auto Int64Ty = IRB.getInt64Ty();
+	auto Int8PtrTy = IRB.getInt8PtrTy();
+	auto BarrierFn = M->getOrInsertFunction("WriteBarrier", IRB.getVoidTy(),
+		Int8PtrTy, Int8PtrTy, Int64Ty);
+	if (auto *BarrierDecl = dyn_cast<Function>(BarrierFn.getCallee())) {
+		BarrierDecl->addParamAttr(0, Attribute::NoCapture);
+		BarrierDecl->addParamAttr(1, Attribute::NoCapture);
+	}
+	IRB.CreateCall(BarrierFn, {IRB.CreatePointerCast(Base, Int8PtrTy),
+		IRB.CreatePointerCast(Ptr, Int8PtrTy),
+		IRB.CreateZExtOrTrunc(Size, Int64Ty)});
 }
 
 bool MemSafe::runOnFunction(Function &F) {
 	TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
-  return true;
+
+	SmallVector<std::pair<AllocaInst*, bool>, 8> EscapingAllocas;
+	SmallVector<ReturnInst*, 4> Returns;
+
+	for (Instruction &I : instructions(F)) {
+		if (auto *AI = dyn_cast<AllocaInst>(&I)) {
+			/* non-escaping allocas stay on the stack and are not checked */
+			bool Captured;
+			if (isEscaping(AI, TLI, &Captured)) {
+				EscapingAllocas.push_back({AI, Captured});
+			}
+		}
+		else if (auto *RI = dyn_cast<ReturnInst>(&I)) {
+			Returns.push_back(RI);
+		}
+	}
+
+	for (auto &Escaping : EscapingAllocas) {
+		promoteToHeap(Escaping.first, Escaping.second, Returns);
+	}
+
+	/* any store that covers a whole pointer slot can overwrite a
+	 * pointer, whatever the type of the stored value: an i64, a
+	 * vector or a union member copied as an integer. Narrower
+	 * stores can't; block writes always get the barrier. */
+	const DataLayout &DL = F.getParent()->getDataLayout();
+	const unsigned PtrSize = DL.getPointerSize();
+	SmallVector<Instruction*, 16> HeapWrites;
+	for (Instruction &I : instructions(F)) {
+		if (auto *SI = dyn_cast<StoreInst>(&I)) {
+			if (DL.getTypeStoreSize(SI->getValueOperand()->getType()) >= PtrSize) {
+				HeapWrites.push_back(SI);
+			}
+		}
+		else if (isa<MemIntrinsic>(&I)) {
+			HeapWrites.push_back(&I);
+		}
+	}
+	for (Instruction *I : HeapWrites) {
+		if (auto *SI = dyn_cast<StoreInst>(I)) {
+			Type *ValTy = SI->getValueOperand()->getType();
+			Value *Size = ConstantInt::get(Type::getInt64Ty(F.getContext()),
+				DL.getTypeStoreSize(ValTy));
+			addWriteBarrier(SI, SI->getPointerOperand(), Size);
+		}
+		else {
+			auto *MI = cast<MemIntrinsic>(I);
+			addWriteBarrier(MI, MI->getRawDest(), MI->getLength());
+		}
+	}
+  return !EscapingAllocas.empty() || !HeapWrites.empty();
 }
 
 char MemSafe::ID = 0;
@@ -0,0 +1,111 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+using namespace llvm;
+
+namespace {
+/* Inserts safepoint polls at function entries and loop backedges,
+ * so that SafeGC can stop all threads for a collection. A poll
+ * tests the flag the collector sets and, on the unlikely path,
+ * calls into the runtime, which parks the thread until the
+ * collection is over.
+ */
+struct SafePoints : public ModulePass {
+  static char ID;
+  SafePoints() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+
+private:
+	void insertPoll(Instruction *InsertPt);
+
+	Constant *Flag = nullptr;
+	FunctionCallee Slow;
+
+}; // end of struct SafePoints
+}  // end of anonymous namespace
+
+/* if (SafepointRequested) safepointPoll(); before InsertPt */
+void SafePoints::insertPoll(Instruction *InsertPt)
+{
+	IRBuilder<> IRB(InsertPt);
+	Value *Requested = IRB.CreateLoad(IRB.getInt32Ty(), Flag, /*isVolatile*/true);
+	Value *Cmp = IRB.CreateICmpNE(Requested, IRB.getInt32(0));
+	MDBuilder MDB(InsertPt->getContext());
+	Instruction *Then = SplitBlockAndInsertIfThen(Cmp, InsertPt, false,
+		MDB.createBranchWeights(1, 1000));
+	IRB.SetInsertPoint(Then);
+	IRB.CreateCall(Slow);
+}
+
+bool SafePoints::runOnModule(Module &M) {
+	LLVMContext &C = M.getContext();
+	auto *FnTy = FunctionType::get(Type::getVoidTy(C), false);
+
+	if (Function *SlowFn = M.getFunction("safepointPoll")) {
+		if (!SlowFn->use_empty()) {
+			/* polls are already placed */
+			return false;
+		}
+	}
+	Flag = M.getOrInsertGlobal("SafepointRequested", Type::getInt32Ty(C));
+	Slow = M.getOrInsertFunction("safepointPoll", FnTy);
+
+	bool Changed = false;
+	for (Function &F : M) {
+		if (F.isDeclaration()) {
+			continue;
+		}
+		/* a backedge goes to a block that dominates its source;
+		 * nothing can go before an exception handling terminator */
+		DominatorTree DT(F);
+		SmallVector<Instruction*, 8> Latches;
+		for (BasicBlock &BB : F) {
+			if (BB.getTerminator()->isEHPad()) {
+				continue;
+			}
+			for (BasicBlock *Succ : successors(&BB)) {
+				if (DT.dominates(Succ, &BB)) {
+					Latches.push_back(BB.getTerminator());
+					break;
+				}
+			}
+		}
+
+		/* after the static allocas, which must stay in the entry block */
+		BasicBlock::iterator Entry = F.getEntryBlock().getFirstInsertionPt();
+		while (isa<AllocaInst>(&*Entry)) {
+			++Entry;
+		}
+		insertPoll(&*Entry);
+		for (Instruction *Term : Latches) {
+			insertPoll(Term);
+		}
+		Changed = true;
+	}
+	return Changed;
+}
+
+char SafePoints::ID = 0;
+static RegisterPass<SafePoints> X("safepoints", "Safepoint Poll Pass",
+                                  false /* Only looks at CFG */,
+                                  false /* Analysis Pass */);
+
+static RegisterStandardPasses Y(
+    PassManagerBuilder::EP_OptimizerLast,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) { PM.add(new SafePoints()); });
@@ -1,5 +1,6 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/IR/IRBuilder.h"
@@ -23,6 +24,7 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
+#include <algorithm>
 #include <deque>
 
 using namespace llvm;
@@ -32,21 +34,45 @@ struct TypeAssigner : public FunctionPass {
   static char ID;
   TypeAssigner() : FunctionPass(ID) {}
 
-	unsigned long long computeBitMap(const DataLayout &DL, Type *Ty)
+	/* a flexible array member: its elements have no offsets
+	 * in the type, the object is bigger than the type */
+	bool hasZeroLengthArray(Type *Ty)
+	{
+		if (auto *ATy = dyn_cast<ArrayType>(Ty)) {
+			return ATy->getNumElements() == 0 || hasZeroLengthArray(ATy->getElementType());
+		}
+		if (auto *STy = dyn_cast<StructType>(Ty)) {
+			for (Type *ETy : STy->elements()) {
+				if (hasZeroLengthArray(ETy)) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	/* Returns false when the pointer slots of the type can't
+	 * be described by a bitmap, and the object is to be left
+	 * untyped. */
+	bool computeBitMap(const DataLayout &DL, Type *Ty, unsigned long long &bitmap)
 	{
 		SmallVector<LLT, 8> ValueVTs;
     SmallVector<uint64_t, 8> Offsets;
 
+		if (hasZeroLengthArray(Ty)) {
+			return false;
+		}
 		computeValueLLTs(DL, *Ty, ValueVTs, &Offsets);
-		unsigned long long bitmap = 0;
-		int bitpos = 0;
+		bitmap = 0;
 
 		for (unsigned i = 0; i < ValueVTs.size(); i++)
 		{
-			bitpos = Offsets[i] / 64;
-			assert(bitpos < 63 && "can not handle more than 63 fields!");
+			uint64_t bitpos = Offsets[i] / 64;
 			if (ValueVTs[i].isPointer())
 			{
+				if (bitpos >= 63) {
+					return false;
+				}
 				bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
 			}
 		}
@@ -55,16 +81,306 @@ struct TypeAssigner : public FunctionPass {
 		{
 			auto Sz = DL.getTypeAllocSize(Ty);
 			assert((Sz & 7) == 0 && "type is not aligned!");
-			bitpos++;
-			bitmap |= (1ULL << bitpos); /* Fixed by Fahad Nayyar */
+			/* the terminating bit is at the element size, trailing
+			 * padding included, so that the bitmap repeats at the
+			 * element size in arrays */
+			if (Sz / 8 > 63) {
+				return false;
+			}
+			bitmap |= (1ULL << (Sz / 8)); /* Fixed by Fahad Nayyar */
+		}
+		return true;
+	}
+
+	/* the allocation holds a whole number of elements: its size
+	 * is a constant, or a count times a constant, that ObjSz
+	 * divides. The collector doesn't know the requested size, it
+	 * would take a malloc(sizeof(T) + N) tail for more elements. */
+	bool isWholeElements(Value *Size, uint64_t ObjSz)
+	{
+		if (ObjSz == 0) {
+			return false;
+		}
+		if (auto *C = dyn_cast<ConstantInt>(Size)) {
+			return C->getValue().urem(ObjSz) == 0;
+		}
+		if (auto *Ext = dyn_cast<CastInst>(Size)) {
+			if (isa<ZExtInst>(Ext) || isa<SExtInst>(Ext)) {
+				return isWholeElements(Ext->getOperand(0), ObjSz);
+			}
+			return false;
+		}
+		auto *BO = dyn_cast<BinaryOperator>(Size);
+		if (!BO) {
+			return false;
+		}
+		if (BO->getOpcode() == Instruction::Mul) {
+			return isWholeElements(BO->getOperand(0), ObjSz)
+				|| isWholeElements(BO->getOperand(1), ObjSz);
+		}
+		if (BO->getOpcode() == Instruction::Shl) {
+			auto *Amt = dyn_cast<ConstantInt>(BO->getOperand(1));
+			if (Amt && Amt->getZExtValue() < 64
+				&& (1ULL << Amt->getZExtValue()) % ObjSz == 0) {
+				return true;
+			}
+			return isWholeElements(BO->getOperand(0), ObjSz);
+		}
+		return false;
+	}
+
+	/* the type an access through a view of the object uses */
+	Type *getViewType(Value *View)
+	{
+		Type *Ty = View->getType()->getPointerElementType();
+		if (Ty->isArrayTy()) {
+			Ty = Ty->getArrayElementType();
+		}
+		return Ty;
+	}
+
+	/* bit offsets of the pointers in a value of type Ty */
+	void getPointerOffsets(const DataLayout &DL, Type *Ty, SmallVectorImpl<uint64_t> &PtrOffsets)
+	{
+		SmallVector<LLT, 8> ValueVTs;
+		SmallVector<uint64_t, 8> Offsets;
+
+		computeValueLLTs(DL, *Ty, ValueVTs, &Offsets);
+		for (unsigned i = 0; i < ValueVTs.size(); i++) {
+			LLT VT = ValueVTs[i];
+			if (VT.isPointer()) {
+				PtrOffsets.push_back(Offsets[i]);
+			}
+			else if (VT.isVector() && VT.getElementType().isPointer()) {
+				for (unsigned j = 0; j < VT.getNumElements(); j++) {
+					PtrOffsets.push_back(Offsets[i] + j * VT.getScalarSizeInBits());
+				}
+			}
+		}
+	}
+
+	/* The bit offsets of the words of V that may hold a pointer:
+	 * its pointer fields, a pointer cast to an integer, or the
+	 * words of a load that copies pointers as integers. Returns
+	 * false when that can't be told. */
+	bool getCarriedPointers(const DataLayout &DL, Value *V, SmallVectorImpl<uint64_t> &PtrOffsets)
+	{
+		getPointerOffsets(DL, V->getType(), PtrOffsets);
+		if (auto *BC = dyn_cast<BitCastInst>(V)) {
+			return getCarriedPointers(DL, BC->getOperand(0), PtrOffsets);
 		}
-		return bitmap;
+		if (isa<PtrToIntInst>(V)) {
+			PtrOffsets.push_back(0);
+			return true;
+		}
+		auto *LI = dyn_cast<LoadInst>(V);
+		if (!LI || !PtrOffsets.empty()) {
+			return true;
+		}
+		Type *SrcTy = LI->getPointerOperand()->stripPointerCasts()->getType()->getPointerElementType();
+		uint64_t LoadSize = DL.getTypeStoreSizeInBits(LI->getType());
+		if (!SrcTy->isSized() || hasZeroLengthArray(SrcTy)
+				|| DL.getTypeStoreSizeInBits(SrcTy) < LoadSize) {
+			return false;
+		}
+		SmallVector<uint64_t, 8> SrcOffsets;
+		getPointerOffsets(DL, SrcTy, SrcOffsets);
+		for (uint64_t Off : SrcOffsets) {
+			if (Off < LoadSize) {
+				PtrOffsets.push_back(Off);
+			}
+		}
+		return true;
+	}
+
+	/* The offset of a GEP from its base, modulo the size Sz of the
+	 * object type, if its variable indices step over whole
+	 * objects. */
+	bool getViewOffset(const DataLayout &DL, GetElementPtrInst *GEP, uint64_t Sz, uint64_t &Offset)
+	{
+		int64_t Off = Offset;
+		for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E; ++GTI) {
+			auto *Idx = dyn_cast<ConstantInt>(GTI.getOperand());
+			if (StructType *STy = GTI.getStructTypeOrNull()) {
+				Off += DL.getStructLayout(STy)->getElementOffset(Idx->getZExtValue());
+				continue;
+			}
+			int64_t Scale = DL.getTypeAllocSize(GTI.getIndexedType());
+			if (Idx) {
+				Off += Idx->getSExtValue() * Scale;
+			}
+			else if (Scale % Sz != 0) {
+				return false;
+			}
+		}
+		Offset = ((Off % (int64_t)Sz) + Sz) % Sz;
+		return true;
+	}
+
+	/* a local variable that is only loaded and stored to */
+	bool isLocalSlot(Value *V)
+	{
+		auto *AI = dyn_cast<AllocaInst>(V);
+		if (!AI) {
+			return false;
+		}
+		for (const Use &U : AI->uses()) {
+			auto *SI = dyn_cast<StoreInst>(U.getUser());
+			if (!isa<LoadInst>(U.getUser()) && !(SI && SI->getPointerOperand() == AI)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/* what is known about the object while its uses are checked */
+	struct ObjLayout {
+		const DataLayout &DL;
+		uint64_t Sz;
+		SmallVector<uint64_t, 8> PtrOffsets;
+		DenseMap<Value*, uint64_t> Visited;
+		ObjLayout(const DataLayout &DL) : DL(DL) {}
+	};
+
+	/* a store of V Offset bytes into the object puts any pointer
+	 * it may hold in a pointer slot */
+	bool isTypedStore(ObjLayout &L, Value *V, uint64_t Offset)
+	{
+		SmallVector<uint64_t, 8> Carried;
+		if (!getCarriedPointers(L.DL, V, Carried)) {
+			return false;
+		}
+		for (uint64_t Off : Carried) {
+			Off = (Offset * 8 + Off) % (L.Sz * 8);
+			if (std::find(L.PtrOffsets.begin(), L.PtrOffsets.end(), Off) == L.PtrOffsets.end()) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/* Checks every use of Ptr, a pointer Offset bytes (modulo the
+	 * type size) into the object. The bitmap describes the object
+	 * only if it is loaded, stored to where stores keep pointers
+	 * in pointer slots, zeroed or copied from, compared, freed or
+	 * passed to a write barrier; and if the pointer itself stays
+	 * in registers and local variables. Anything else, e.g. a
+	 * memcpy into the object, a call or a store of the pointer to
+	 * memory, may put a pointer where the bitmap has none. */
+	bool hasTypedUses(ObjLayout &L, Value *Ptr, uint64_t Offset)
+	{
+		auto It = L.Visited.find(Ptr);
+		if (It != L.Visited.end()) {
+			return It->second == Offset;
+		}
+		L.Visited[Ptr] = Offset;
+
+		for (const Use &U : Ptr->uses()) {
+			auto *I = cast<Instruction>(U.getUser());
+			if (isa<LoadInst>(I) || isa<ICmpInst>(I) || isa<DbgInfoIntrinsic>(I)) {
+				continue;
+			}
+			if (isa<BitCastInst>(I) || isa<PHINode>(I) || isa<SelectInst>(I)) {
+				if (!hasTypedUses(L, I, Offset)) {
+					return false;
+				}
+				continue;
+			}
+			if (auto *GEP = dyn_cast<GetElementPtrInst>(I)) {
+				uint64_t GEPOffset = Offset;
+				if (!getViewOffset(L.DL, GEP, L.Sz, GEPOffset)
+						|| !hasTypedUses(L, GEP, GEPOffset)) {
+					return false;
+				}
+				continue;
+			}
+			if (auto *SI = dyn_cast<StoreInst>(I)) {
+				if (SI->getPointerOperand() == Ptr) {
+					if (!isTypedStore(L, SI->getValueOperand(), Offset)) {
+						return false;
+					}
+					continue;
+				}
+				/* kept in a local variable: follow its loads */
+				if (Offset != 0 || !isLocalSlot(SI->getPointerOperand())) {
+					return false;
+				}
+				for (User *SlotUser : SI->getPointerOperand()->users()) {
+					auto *Load = dyn_cast<LoadInst>(SlotUser);
+					if (Load && !hasTypedUses(L, Load, 0)) {
+						return false;
+					}
+				}
+				continue;
+			}
+			if (auto *MI = dyn_cast<MemIntrinsic>(I)) {
+				auto *MT = dyn_cast<MemTransferInst>(MI);
+				if (isa<MemSetInst>(MI) || (MT && MT->getRawDest() != Ptr)) {
+					continue;
+				}
+				return false;
+			}
+			if (auto *II = dyn_cast<IntrinsicInst>(I)) {
+				if (II->isLifetimeStartOrEnd()) {
+					continue;
+				}
+				return false;
+			}
+			auto *Call = dyn_cast<CallInst>(I);
+			Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+			if (Callee && (Callee->getName() == "WriteBarrier"
+					|| Callee->getName() == "myfree")) {
+				continue;
+			}
+			return false;
+		}
+		return true;
+	}
+
+	/* An allocation is usually cast to several types: the type
+	 * of the object, and, after instcombine, the types of the
+	 * fields accessed through it. The object gets the biggest
+	 * type it is cast to, if its uses keep to the layout of that
+	 * type; returns the cast to that type, or null for an object
+	 * to be left untyped. */
+	Instruction *findTypedView(const DataLayout &DL, CallInst *CI)
+	{
+		Instruction *Typed = nullptr;
+
+		for (User *U : CI->users()) {
+			auto *BC = dyn_cast<BitCastInst>(U);
+			if (!BC) {
+				continue;
+			}
+			Type *Ty = getViewType(BC);
+			if (!Ty->isSized()) {
+				return nullptr;
+			}
+			if (!Typed || DL.getTypeAllocSize(Ty) > DL.getTypeAllocSize(getViewType(Typed))) {
+				Typed = BC;
+			}
+		}
+		if (!Typed) {
+			return nullptr;
+		}
+		Type *Ty = getViewType(Typed);
+		ObjLayout L(DL);
+		L.Sz = DL.getTypeAllocSize(Ty);
+		if (L.Sz == 0 || hasZeroLengthArray(Ty)) {
+			return nullptr;
+		}
+		getPointerOffsets(DL, Ty, L.PtrOffsets);
+		if (!hasTypedUses(L, CI, 0)) {
+			return nullptr;
+		}
+		return Typed;
 	}
 
   bool runOnFunction(Function &F) override {
 
 		const DataLayout &DL = F.getParent()->getDataLayout();
 		auto Int8PtrTy = Type::getInt8PtrTy(F.getParent()->getContext());
+		SmallVector<CallInst*, 8> PointerFreeAllocs;
 
 		for (BasicBlock &BB : F)
 		{
@@ -77,24 +393,28 @@ struct TypeAssigner : public FunctionPass {
 
 					if (!Callee->getName().compare("mymalloc"))
 					{
-						Instruction *InsertPt = CI;
+						Instruction *InsertPt = nullptr;
 						if (CI->getType() == Int8PtrTy) {
-    					for (const Use &UI : CI->uses()) {
-      					auto I = cast<Instruction>(UI.getUser());
-								if (isa<BitCastInst>(I)) {
-									InsertPt = I;
-									break;
-								}
-							}
+							InsertPt = findTypedView(DL, CI);
+						}
+						if (!InsertPt) {
+							/* the layout is unknown: leave the object untyped,
+							 * so that the collector scans it conservatively */
+							continue;
 						}
 						assert(InsertPt->getType()->isPointerTy());
 						
-						Type *PTy = InsertPt->getType()->getPointerElementType();
-						if (PTy->isArrayTy()) {
-							PTy = PTy->getArrayElementType();
-						}
+						Type *PTy = getViewType(InsertPt);
 						auto ObjSz = DL.getTypeAllocSize(PTy);
-						unsigned long long bitmap = computeBitMap(DL, PTy);
+						unsigned long long bitmap;
+						if (!computeBitMap(DL, PTy, bitmap)
+							|| !isWholeElements(CI->getArgOperand(0), ObjSz)) {
+							continue;
+						}
+						if (bitmap == 0) {
+							PointerFreeAllocs.push_back(CI);
+							continue;
+						}
 
 						IRBuilder<> IRB(InsertPt->getNextNode());
 						Module *M = F.getParent();
@@ -107,7 +427,29 @@ struct TypeAssigner : public FunctionPass {
 			}
 		}
 
-    return false;
+		/* objects that are a whole number of elements without
+		 * pointer fields are allocated on pages that the collector
+		 * never scans; with a flexible array member or extra bytes,
+		 * the rest of the object may hold pointers */
+		for (CallInst *CI : PointerFreeAllocs) {
+			Module *M = F.getParent();
+			IRBuilder<> IRB(CI);
+			auto Int64Ty = IRB.getInt64Ty();
+			auto Fn = M->getOrInsertFunction("mymallocTyped", Int8PtrTy,
+				CI->getArgOperand(0)->getType(), Int64Ty);
+			auto *TypedDecl = dyn_cast<Function>(Fn.getCallee());
+			auto *MallocDecl = dyn_cast<Function>(CI->getCalledValue()->stripPointerCasts());
+			if (TypedDecl && MallocDecl && TypedDecl->getAttributes().isEmpty()) {
+				/* same allocator attributes as mymalloc */
+				TypedDecl->setAttributes(MallocDecl->getAttributes());
+			}
+			CallInst *NewCI = IRB.CreateCall(Fn, {CI->getArgOperand(0),
+				ConstantInt::get(Int64Ty, 0)});
+			NewCI->takeName(CI);
+			CI->replaceAllUsesWith(NewCI);
+			CI->eraseFromParent();
+		}
+    return !PointerFreeAllocs.empty();
   }
 }; // end of struct TypeAssigner
 }  // end of anonymous namespace
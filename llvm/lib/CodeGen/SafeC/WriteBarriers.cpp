@@ -0,0 +1,92 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+using namespace llvm;
+
+namespace {
+/* Inlines the fast path of the write barriers placed by MemSafe.
+ * The barrier has work to do only while the collector marks
+ * concurrently or tracks dirty cards, so each call is guarded by
+ * a test of the two flags and taken on the unlikely path only.
+ * This runs after HeapToStack, which drops the barriers of the
+ * objects it moves to the stack, so that SROA sees plain stores.
+ */
+struct WriteBarriers : public ModulePass {
+  static char ID;
+  WriteBarriers() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+
+private:
+	void insertFastPath(CallInst *Barrier);
+
+	Constant *Marking = nullptr;
+	Constant *CardMarking = nullptr;
+
+}; // end of struct WriteBarriers
+}  // end of anonymous namespace
+
+/* if (MarkingActive | CardMarkingActive) WriteBarrier(...);
+ * WriteBarrier tests the flags again, with the ordering the
+ * runtime needs, so plain volatile loads do here. */
+void WriteBarriers::insertFastPath(CallInst *Barrier)
+{
+	IRBuilder<> IRB(Barrier);
+	Value *Active = IRB.CreateOr(
+		IRB.CreateLoad(IRB.getInt32Ty(), Marking, /*isVolatile*/true),
+		IRB.CreateLoad(IRB.getInt32Ty(), CardMarking, /*isVolatile*/true));
+	Value *Cmp = IRB.CreateICmpNE(Active, IRB.getInt32(0));
+	MDBuilder MDB(Barrier->getContext());
+	Instruction *Then = SplitBlockAndInsertIfThen(Cmp, Barrier, false,
+		MDB.createBranchWeights(1, 1000));
+	Barrier->moveBefore(Then);
+}
+
+bool WriteBarriers::runOnModule(Module &M) {
+	LLVMContext &C = M.getContext();
+
+	Function *BarrierFn = M.getFunction("WriteBarrier");
+	if (!BarrierFn || BarrierFn->use_empty()) {
+		return false;
+	}
+	if (M.getNamedGlobal("MarkingActive")) {
+		/* fast paths are already inlined */
+		return false;
+	}
+	Marking = M.getOrInsertGlobal("MarkingActive", Type::getInt32Ty(C));
+	CardMarking = M.getOrInsertGlobal("CardMarkingActive", Type::getInt32Ty(C));
+
+	SmallVector<CallInst*, 16> Barriers;
+	for (User *U : BarrierFn->users()) {
+		auto *CI = dyn_cast<CallInst>(U);
+		if (CI && CI->getCalledFunction() == BarrierFn) {
+			Barriers.push_back(CI);
+		}
+	}
+	for (CallInst *CI : Barriers) {
+		insertFastPath(CI);
+	}
+	return !Barriers.empty();
+}
+
+char WriteBarriers::ID = 0;
+static RegisterPass<WriteBarriers> X("writebarriers", "Write Barrier Pass",
+                                     false /* Only looks at CFG */,
+                                     false /* Analysis Pass */);
+
+static RegisterStandardPasses Y(
+    PassManagerBuilder::EP_OptimizerLast,
+    [](const PassManagerBuilder &Builder,
+       legacy::PassManagerBase &PM) { PM.add(new WriteBarriers()); });
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "memory.h"
+#include "heap.h"
+
+#define DEFAULT_MIN_HEAP (32ULL << 20)
+#define DEFAULT_GROWTH_FACTOR 2.0
+#define MIN_GROWTH_FACTOR 1.1
+#define MIN_GC_BUDGET (1ULL << 20)
+#define MINOR_GCS_PER_MAJOR 8
+
+long long NumGCTriggered = 0;
+long long NumMinorGCs = 0;
+/* set by the collector to stop the mutator threads at
+ * their next safepoint poll */
+int SafepointRequested = 0;
+/* set while a concurrent mark is running; the write
+ * barriers log overwritten pointers and new objects are
+ * allocated marked */
+int MarkingActive = 0;
+/* set in generational mode once the first collection has
+ * promoted objects; the write barriers dirty the cards */
+int CardMarkingActive = 0;
+
+static pthread_mutex_t SafepointLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SafepointDone = PTHREAD_COND_INITIALIZER;
+
+/* full SATB buffers waiting for the concurrent marker */
+static SatbBuffer *FullSatbBuffers = NULL;
+static pthread_mutex_t SatbLock = PTHREAD_MUTEX_INITIALIZER;
+/* big objects freed during a concurrent mark, linked
+ * through their payload and reclaimed after the mark */
+char *DeferredBigFrees = NULL;
+
+/* hand the SATB buffer of a thread to the concurrent marker */
+void flushSatbBuffer(ThreadCache *TC)
+{
+	SatbBuffer *Buf = TC->Satb;
+	if (Buf == NULL)
+	{
+		return;
+	}
+	TC->Satb = NULL;
+	pthread_mutex_lock(&SatbLock);
+	Buf->Next = FullSatbBuffers;
+	FullSatbBuffers = Buf;
+	pthread_mutex_unlock(&SatbLock);
+}
+
+/* Write barrier slow path, called before Size bytes at Slot
+ * are overwritten during a concurrent mark. The old values
+ * are logged, so that everything reachable when the mark
+ * started gets marked (snapshot at the beginning). A store
+ * that isn't word aligned touches the words on both sides.
+ */
+void recordOverwrite(void *Slot, size_t Size)
+{
+	ThreadCache *TC = getThreadCache();
+	char *Cur = (char*)((ulong64)Slot & ~(sizeof(void*) - 1));
+	char *End = (char*)Align((ulong64)Slot + Size, sizeof(void*));
+
+	for (; Cur + sizeof(void*) <= End; Cur += sizeof(void*))
+	{
+		void *Old;
+		memcpy(&Old, Cur, sizeof(void*));
+		if (Old == NULL)
+		{
+			continue;
+		}
+		if (TC->Satb != NULL && TC->Satb->Count == SATB_BUFFER_SIZE)
+		{
+			flushSatbBuffer(TC);
+		}
+		if (TC->Satb == NULL)
+		{
+			TC->Satb = malloc(sizeof(SatbBuffer));
+			if (TC->Satb == NULL)
+			{
+				printf("Unable to allocate SATB buffer\n");
+				exit(0);
+			}
+			TC->Satb->Count = 0;
+		}
+		TC->Satb->Entries[TC->Satb->Count++] = Old;
+	}
+}
+
+/* Ask all other registered threads to stop and wait until
+ * each one is parked: in a safepoint poll, a blocking call,
+ * or waiting for the heap lock.
+ */
+static long long PauseStartNs;
+/* longest pause since the GC trigger was last updated */
+static long long CyclePauseNs = 0;
+
+static void stopTheWorld()
+{
+	ThreadCache *TC;
+
+	PauseStartNs = getTimeNs();
+	__atomic_store_n(&SafepointRequested, 1, __ATOMIC_SEQ_CST);
+	for (TC = ThreadCaches; TC != NULL; TC = TC->Next)
+	{
+		while (TC != MyCache && !__atomic_load_n(&TC->Parked, __ATOMIC_SEQ_CST))
+		{
+			sched_yield();
+		}
+	}
+}
+
+static void resumeTheWorld()
+{
+	long long Pause = getTimeNs() - PauseStartNs;
+
+	recordPause(Pause);
+	CyclePauseNs = (Pause > CyclePauseNs) ? Pause : CyclePauseNs;
+	pthread_mutex_lock(&SafepointLock);
+	__atomic_store_n(&SafepointRequested, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&SafepointDone);
+	pthread_mutex_unlock(&SafepointLock);
+}
+
+/* Unpark a parked thread once no collection is running. A
+ * collection that starts as the thread unparks sees either
+ * the thread still parked, or the thread sees the request
+ * and parks again.
+ */
+void unparkThread(ThreadCache *TC)
+{
+	pthread_mutex_lock(&SafepointLock);
+	while (1)
+	{
+		while (__atomic_load_n(&SafepointRequested, __ATOMIC_SEQ_CST))
+		{
+			pthread_cond_wait(&SafepointDone, &SafepointLock);
+		}
+		__atomic_store_n(&TC->Parked, 0, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&SafepointRequested, __ATOMIC_SEQ_CST))
+		{
+			break;
+		}
+		__atomic_store_n(&TC->Parked, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&SafepointLock);
+}
+
+/* park a thread until the collection that stopped it is over */
+static void waitForCollection(ThreadCache *TC)
+{
+	__atomic_store_n(&TC->Parked, 1, __ATOMIC_SEQ_CST);
+	unparkThread(TC);
+}
+
+/* Trigger policy: the next collection starts once the heap
+ * has grown by GrowthFactor over the bytes the last one found
+ * live, with the heap limit kept between the minimum and the
+ * maximum heap size. With a pause time goal, the factor shrinks
+ * while the pauses exceed the goal, as a shorter interval leaves
+ * less to mark for minor and concurrent collections, and grows
+ * back to the configured factor when they are well below it.
+ * SAFEGC_GROWTH_FACTOR, SAFEGC_MIN_HEAP_MB, SAFEGC_MAX_HEAP_MB
+ * (0 for no limit) and SAFEGC_PAUSE_GOAL_MS override the defaults.
+ */
+static double GrowthFactor = DEFAULT_GROWTH_FACTOR;
+static double MaxGrowthFactor = DEFAULT_GROWTH_FACTOR;
+static size_t MinHeapSize = DEFAULT_MIN_HEAP;
+static size_t MaxHeapSize = 0;
+static long long PauseGoalNs = 0;
+/* bytes marked by the last collection */
+size_t LiveBytes = 0;
+/* bytes to allocate before the next collection */
+static size_t GCBudget = DEFAULT_MIN_HEAP;
+size_t AllocSinceGC = 0;
+/* bytes allocated between the last two collections */
+static size_t AllocBeforeGC = 0;
+
+static void initGCPolicy()
+{
+	static int Initialized = 0;
+	char *Env;
+
+	if (Initialized)
+	{
+		return;
+	}
+	Initialized = 1;
+	Env = getenv("SAFEGC_GROWTH_FACTOR");
+	if (Env != NULL && atof(Env) >= MIN_GROWTH_FACTOR)
+	{
+		MaxGrowthFactor = atof(Env);
+	}
+	Env = getenv("SAFEGC_MIN_HEAP_MB");
+	if (Env != NULL && atoi(Env) > 0)
+	{
+		MinHeapSize = (size_t)atoi(Env) << 20;
+	}
+	Env = getenv("SAFEGC_MAX_HEAP_MB");
+	if (Env != NULL && atoi(Env) > 0)
+	{
+		MaxHeapSize = (size_t)atoi(Env) << 20;
+	}
+	Env = getenv("SAFEGC_PAUSE_GOAL_MS");
+	if (Env != NULL && atoi(Env) > 0)
+	{
+		PauseGoalNs = atoi(Env) * 1000000LL;
+	}
+	GrowthFactor = MaxGrowthFactor;
+	GCBudget = MinHeapSize;
+}
+
+/* called at the end of every collection, once LiveBytes is set */
+static void updateGCTrigger()
+{
+	initGCPolicy();
+	if (PauseGoalNs > 0)
+	{
+		if (CyclePauseNs > PauseGoalNs)
+		{
+			GrowthFactor *= 0.75;
+		}
+		else if (CyclePauseNs < PauseGoalNs / 2)
+		{
+			GrowthFactor *= 1.25;
+		}
+		GrowthFactor = (GrowthFactor < MIN_GROWTH_FACTOR) ? MIN_GROWTH_FACTOR : GrowthFactor;
+		GrowthFactor = (GrowthFactor > MaxGrowthFactor) ? MaxGrowthFactor : GrowthFactor;
+	}
+	CyclePauseNs = 0;
+
+	size_t Limit = LiveBytes * GrowthFactor;
+	if (Limit < MinHeapSize)
+	{
+		Limit = MinHeapSize;
+	}
+	if (MaxHeapSize != 0 && Limit > MaxHeapSize)
+	{
+		Limit = MaxHeapSize;
+	}
+	GCBudget = (Limit > LiveBytes + MIN_GC_BUDGET) ? Limit - LiveBytes : MIN_GC_BUDGET;
+}
+
+int isGenerationalMode()
+{
+	static int GenerationalMode = -1;
+
+	if (GenerationalMode == -1)
+	{
+		char *Env = getenv("SAFEGC_GENERATIONAL");
+		GenerationalMode = (Env != NULL && atoi(Env) > 0);
+	}
+	return GenerationalMode;
+}
+
+/* Called with the heap lock held, by a registered thread.
+ * The world is stopped while the roots are marked and the
+ * thread caches are reset; sweeping runs concurrently with
+ * the mutators.
+ */
+static void collect()
+{
+	int Compact;
+	long long Start;
+
+	NumGCTriggered++;
+	beginGCEvent(GC_FULL, LiveBytes + AllocBeforeGC);
+
+	/* the marks of the previous GC must be gone */
+	sweep();
+	stopTheWorld();
+	clearMarks();
+	resetMarkedBytes();
+	Compact = shouldCompact();
+	PinningActive = Compact;
+	Start = getTimeNs();
+	markRoots();
+	endPhase(GC_PHASE_ROOTS, Start);
+	markHeap();
+	PinningActive = 0;
+	if (Compact)
+	{
+		Start = getTimeNs();
+		compactHeap();
+		endPhase(GC_PHASE_COMPACT, Start);
+	}
+	queueUnsweptPages(0);
+	if (isGenerationalMode())
+	{
+		/* every old object has been traced */
+		clearCards();
+		CardMarkingActive = 1;
+	}
+	resumeTheWorld();
+	LiveBytes = getMarkedBytes();
+	endGCEvent(LiveBytes);
+	updateGCTrigger();
+	scheduleDecommit();
+}
+
+/* Generational mode (SAFEGC_GENERATIONAL=1): the marks of the
+ * survivors are kept after a collection, and the marked objects
+ * form the old generation. A minor collection doesn't clear the
+ * marks, so tracing stops at old objects; it marks from the roots
+ * and the dirty cards, and sweeps the nursery pages only. The
+ * survivors are promoted in place, as their pages are swept.
+ */
+static void collectMinor()
+{
+	long long Start;
+
+	NumGCTriggered++;
+	NumMinorGCs++;
+	beginGCEvent(GC_MINOR, LiveBytes + AllocBeforeGC);
+
+	sweep();
+	stopTheWorld();
+	resetMarkedBytes();
+	Start = getTimeNs();
+	markRoots();
+	markDirtyCards();
+	endPhase(GC_PHASE_ROOTS, Start);
+	markHeap();
+	queueUnsweptPages(1);
+	resumeTheWorld();
+	/* the old objects that died stay counted until a full GC */
+	LiveBytes += getMarkedBytes();
+	endGCEvent(LiveBytes);
+	updateGCTrigger();
+	scheduleDecommit();
+}
+
+/* slow path of the safepoint polls that the SafeC pipeline
+ * inserts at function entries and loop backedges. The
+ * safepointPoll wrapper has spilled the registers above
+ * this frame.
+ */
+void _safepointPoll()
+{
+	ThreadCache *TC = getThreadCache();
+	int Lvar;
+
+	TC->StackTop = (unsigned*)Align((ulong64)&Lvar, 4);
+	waitForCollection(TC);
+}
+
+/* Run Fn(Arg) parked, so that collections don't wait for
+ * a thread that blocks outside instrumented code. Fn must
+ * not touch the GC heap.
+ */
+void* __attribute__((noinline)) callBlocking(void *(*Fn)(void*), void *Arg)
+{
+	ThreadCache *TC = getThreadCache();
+	int Lvar;
+
+	__builtin_unwind_init();
+	TC->StackTop = (unsigned*)Align((ulong64)&Lvar, 4);
+	__atomic_store_n(&TC->Parked, 1, __ATOMIC_SEQ_CST);
+	void *Ret = Fn(Arg);
+	waitForCollection(TC);
+	return Ret;
+}
+
+/* Concurrent mode (SAFEGC_CONCURRENT=1): a short pause marks
+ * the objects referenced from the roots, a background thread
+ * traces the heap while the mutators run, and a final pause
+ * drains the SATB buffers and rescans the roots.
+ */
+static int ConcurrentMode = -1;
+static int CycleActive = 0;
+static pthread_mutex_t CycleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t CycleStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t CycleDone = PTHREAD_COND_INITIALIZER;
+static pthread_t MarkerThread;
+
+int isConcurrentMode()
+{
+	if (ConcurrentMode == -1)
+	{
+		char *Env = getenv("SAFEGC_CONCURRENT");
+		ConcurrentMode = (Env != NULL && atoi(Env) > 0);
+	}
+	return ConcurrentMode;
+}
+
+static int isCycleActive()
+{
+	return __atomic_load_n(&CycleActive, __ATOMIC_ACQUIRE);
+}
+
+/* mark the logged pointers. All is set in the final pause,
+ * when the partial buffers of the stopped threads are
+ * drained as well. */
+static void drainSatbBuffers(int All)
+{
+	SatbBuffer *Buf;
+	ThreadCache *TC;
+
+	pthread_mutex_lock(&SatbLock);
+	Buf = FullSatbBuffers;
+	FullSatbBuffers = NULL;
+	pthread_mutex_unlock(&SatbLock);
+
+	for (TC = ThreadCaches; All && TC != NULL; TC = TC->Next)
+	{
+		if (TC->Satb != NULL)
+		{
+			TC->Satb->Next = Buf;
+			Buf = TC->Satb;
+			TC->Satb = NULL;
+		}
+	}
+	while (Buf != NULL)
+	{
+		SatbBuffer *Next = Buf->Next;
+		unsigned Idx;
+		for (Idx = 0; Idx < Buf->Count; Idx++)
+		{
+			markPtr(Buf->Entries[Idx]);
+		}
+		free(Buf);
+		Buf = Next;
+	}
+}
+
+static void reclaimDeferredFrees()
+{
+	while (DeferredBigFrees != NULL)
+	{
+		ObjHeader *Header = (ObjHeader*)DeferredBigFrees;
+		DeferredBigFrees = *(char**)((char*)Header + OBJ_HEADER_SIZE);
+		queueDecommit((char*)Header, Header->Size, 0);
+	}
+}
+
+static void finishConcurrentMark()
+{
+	long long Start;
+
+	lockHeap();
+	stopTheWorld();
+	drainSatbBuffers(1);
+	Start = getTimeNs();
+	markRoots();
+	endPhase(GC_PHASE_ROOTS, Start);
+	markHeap();
+	__atomic_store_n(&MarkingActive, 0, __ATOMIC_SEQ_CST);
+	reclaimDeferredFrees();
+	queueUnsweptPages(0);
+	resumeTheWorld();
+	LiveBytes = getMarkedBytes();
+	endGCEvent(LiveBytes);
+	updateGCTrigger();
+	scheduleDecommit();
+	unlockHeap();
+}
+
+static void* concurrentMarker(void *Arg)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&CycleLock);
+		while (!CycleActive)
+		{
+			pthread_cond_wait(&CycleStart, &CycleLock);
+		}
+		pthread_mutex_unlock(&CycleLock);
+
+		markHeap();
+		while (__atomic_load_n(&FullSatbBuffers, __ATOMIC_ACQUIRE) != NULL)
+		{
+			drainSatbBuffers(0);
+			markHeap();
+		}
+		finishConcurrentMark();
+
+		pthread_mutex_lock(&CycleLock);
+		__atomic_store_n(&CycleActive, 0, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&CycleDone);
+		pthread_mutex_unlock(&CycleLock);
+	}
+	return NULL;
+}
+
+/* initial pause, called with the heap lock held */
+static void startConcurrentMark()
+{
+	static int MarkerStarted = 0;
+	long long Start;
+
+	NumGCTriggered++;
+	beginGCEvent(GC_CONCURRENT, LiveBytes + AllocBeforeGC);
+
+	/* the marks of the previous GC must be gone */
+	sweep();
+	stopTheWorld();
+	clearMarks();
+	resetMarkedBytes();
+	Start = getTimeNs();
+	markRoots();
+	markRootChunks();
+	endPhase(GC_PHASE_ROOTS, Start);
+	__atomic_store_n(&MarkingActive, 1, __ATOMIC_SEQ_CST);
+	resumeTheWorld();
+
+	pthread_mutex_lock(&CycleLock);
+	if (!MarkerStarted)
+	{
+		if (createThread(&MarkerThread, concurrentMarker, NULL) != 0)
+		{
+			printf("Unable to create marker thread\n");
+			exit(0);
+		}
+		MarkerStarted = 1;
+	}
+	__atomic_store_n(&CycleActive, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&CycleStart);
+	pthread_mutex_unlock(&CycleLock);
+}
+
+/* park until the running concurrent mark is over */
+static void __attribute__((noinline)) waitForConcurrentMark(ThreadCache *TC)
+{
+	int Lvar;
+
+	__builtin_unwind_init();
+	TC->StackTop = (unsigned*)Align((ulong64)&Lvar, 4);
+	__atomic_store_n(&TC->Parked, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&CycleLock);
+	while (CycleActive)
+	{
+		pthread_cond_wait(&CycleDone, &CycleLock);
+	}
+	pthread_mutex_unlock(&CycleLock);
+	waitForCollection(TC);
+}
+
+/* explicit GC: collect and sweep the whole heap */
+void _runGC()
+{
+	ThreadCache *TC = getThreadCache();
+
+	while (1)
+	{
+		lockHeap();
+		if (!isCycleActive())
+		{
+			break;
+		}
+		unlockHeap();
+		waitForConcurrentMark(TC);
+	}
+	AllocBeforeGC = AllocSinceGC;
+	AllocSinceGC = 0;
+	collect();
+	sweep();
+	/* the sweep has freed everything, release it now rather
+	 * than at the next collection */
+	scheduleDecommit();
+	unlockHeap();
+}
+
+void checkAndRunGC(size_t Sz)
+{
+	static unsigned MinorsSinceMajor = 0;
+
+	initGCPolicy();
+	AllocSinceGC += Sz;
+	if (AllocSinceGC < GCBudget)
+	{
+		return;
+	}
+	AllocBeforeGC = AllocSinceGC;
+	AllocSinceGC = 0;
+	if (isConcurrentMode())
+	{
+		if (!isCycleActive())
+		{
+			startConcurrentMark();
+		}
+	}
+	else if (isGenerationalMode() && CardMarkingActive
+		&& ++MinorsSinceMajor < MINOR_GCS_PER_MAJOR)
+	{
+		collectMinor();
+	}
+	else
+	{
+		MinorsSinceMajor = 0;
+		collect();
+	}
+}
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "heap.h"
+
+#define DEFAULT_COMPACT_OCCUPANCY 25
+
+long long NumPagesEvacuated = 0;
+long long NumBytesMoved = 0;
+
+/* Mostly-copying compaction, after Bartlett: every
+ * SAFEGC_COMPACT_INTERVAL full collections (never by default),
+ * the pages that the conservative references (the roots, the
+ * untyped objects, and the words of typed objects outside their
+ * pointer slots) point to are pinned while marking. The
+ * live objects of the unpinned pages that are at most
+ * SAFEGC_COMPACT_OCCUPANCY percent full are then copied to
+ * fresh pages, so that their old pages are released by the
+ * sweep. Their remaining references are the pointer slots of
+ * typed objects, which are updated through a forwarding address
+ * left in the old copy.
+ */
+static unsigned CompactInterval = 0;
+static unsigned CompactOccupancy = DEFAULT_COMPACT_OCCUPANCY;
+static unsigned GCsSinceCompact = 0;
+
+int shouldCompact()
+{
+	static int Initialized = 0;
+	char *Env;
+
+	if (!Initialized)
+	{
+		Initialized = 1;
+		Env = getenv("SAFEGC_COMPACT_INTERVAL");
+		if (Env != NULL && atoi(Env) > 0)
+		{
+			CompactInterval = atoi(Env);
+		}
+		Env = getenv("SAFEGC_COMPACT_OCCUPANCY");
+		if (Env != NULL && atoi(Env) > 0 && atoi(Env) <= 100)
+		{
+			CompactOccupancy = atoi(Env);
+		}
+	}
+	if (CompactInterval == 0 || ++GCsSinceCompact < CompactInterval)
+	{
+		return 0;
+	}
+	GCsSinceCompact = 0;
+	return 1;
+}
+
+/* A page is evacuated when it is sparse and none of its live
+ * objects was handed out at an aligned address. Pages with a
+ * single slot (the 2048 and 4096 byte classes) gain nothing
+ * from it, and headerless pages (objects of up to 32 bytes)
+ * have no room for the forwarding state, so these are never
+ * compacted.
+ */
+static int isEvacuationCandidate(char *Page)
+{
+	PageInfo *Info = getPageInfo(Page);
+	unsigned ClassSize = SizeClasses[Info->Class];
+	unsigned NumSlots = getNumSlots(Info->Class);
+	unsigned NumLive = 0;
+	ulong64 Bit;
+	ulong64 *Words = getMarkWord(Page, &Bit);
+	unsigned Idx;
+
+	if ((Info->Flags & PAGE_PINNED) || NumSlots == 1 || isHeaderlessClass(Info->Class))
+	{
+		return 0;
+	}
+	for (Idx = 0; Idx < PAGE_MARK_WORDS; Idx++)
+	{
+		NumLive += __builtin_popcountll(Words[Idx]);
+	}
+	if (NumLive == 0 || NumLive * 100 > NumSlots * CompactOccupancy)
+	{
+		return 0;
+	}
+	for (Idx = 0; Idx < NumSlots; Idx++)
+	{
+		ObjHeader *Header = (ObjHeader*)(Page + Idx * ClassSize);
+		if (isMarked(Header) && Header->Alignment != 0)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* copy the live objects of a page to the target page of its
+ * class; the copies are marked, the originals are not. A copy
+ * counts as allocated, its original as freed once forwarded. */
+static void evacuatePage(char *Page, char **Targets)
+{
+	PageInfo *Info = getPageInfo(Page);
+	unsigned Class = Info->Class;
+	unsigned ClassSize = SizeClasses[Class];
+	unsigned Idx;
+
+	for (Idx = 0; Idx < getNumSlots(Class); Idx++)
+	{
+		ObjHeader *Header = (ObjHeader*)(Page + Idx * ClassSize);
+		if (!isMarked(Header))
+		{
+			continue;
+		}
+		if (Targets[Class] == NULL || getPageInfo(Targets[Class])->FreeList == NULL)
+		{
+			/* the target pages are swept like the others */
+			Targets[Class] = createPage(Class);
+			getPageInfo(Targets[Class])->Flags &= ~PAGE_LISTED;
+		}
+		PageInfo *TargetInfo = getPageInfo(Targets[Class]);
+		ObjHeader *Copy = (ObjHeader*)TargetInfo->FreeList;
+		TargetInfo->FreeList = *(char**)((char*)Copy + OBJ_HEADER_SIZE);
+		TargetInfo->NumFree--;
+
+		memcpy(Copy, Header, ClassSize);
+		setMark(Copy);
+		clearMark(Header);
+		Header->Status |= FORWARDED;
+		*(ObjHeader**)((char*)Header + OBJ_HEADER_SIZE) = Copy;
+		NumBytesMoved += ClassSize;
+		NumBytesAllocated += ClassSize;
+	}
+	NumPagesEvacuated++;
+}
+
+/* point the pointer slots of a typed object to the
+ * new copies of the objects that have moved; the tail
+ * after the last whole element was scanned conservatively,
+ * so what it points to has been pinned */
+static void updateObjPointers(ObjHeader *Header)
+{
+	ulong64 Type;
+	if (!getObjType(Header, &Type) || Type == 0)
+	{
+		return;
+	}
+	unsigned NumSlots = 63 - __builtin_clzll(Type);
+	ulong64 PtrSlots = Type & ~(1ULL << NumSlots);
+	void **Slots = (void**)getObjPayload(Header);
+	size_t Last = ((char*)Header + getObjSize(Header) - (char*)Slots) / sizeof(void*);
+	size_t Base;
+
+	Last = Last / NumSlots * NumSlots;
+
+	if (PtrSlots == 0)
+	{
+		return;
+	}
+	for (Base = 0; Base < Last; Base += NumSlots)
+	{
+		ulong64 Bits = PtrSlots;
+		while (Bits != 0)
+		{
+			size_t Idx = Base + __builtin_ctzll(Bits);
+			Bits &= Bits - 1;
+			if (Idx >= Last)
+			{
+				break;
+			}
+			ObjHeader *Target = findObjHeader(Slots[Idx]);
+			if (Target != NULL && isObjForwarded(Target))
+			{
+				char *Copy = *(char**)((char*)Target + OBJ_HEADER_SIZE);
+				Slots[Idx] = Copy + ((char*)Slots[Idx] - (char*)Target);
+			}
+		}
+	}
+}
+
+static void updateHeapPointers()
+{
+	SegmentList *L;
+
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		char *Page;
+
+		for (Page = getDataPtr(Seg); Page < getAllocPtr(Seg); Page += PAGE_SIZE)
+		{
+			if (getBigAlloc(Seg))
+			{
+				ObjHeader *Header = (ObjHeader*)Page;
+				if (getSizeMetadata(Page)[0] == 1 && isMarked(Header))
+				{
+					updateObjPointers(Header);
+				}
+				continue;
+			}
+			PageInfo *Info = getPageInfo(Page);
+			if (Info->Class == NO_CLASS || isPointerFreePage(Info))
+			{
+				continue;
+			}
+			ulong64 Bit;
+			ulong64 *Words = getMarkWord(Page, &Bit);
+			unsigned Idx;
+			for (Idx = 0; Idx < PAGE_MARK_WORDS; Idx++)
+			{
+				ulong64 Word = Words[Idx];
+				while (Word != 0)
+				{
+					unsigned Granule = Idx * 64 + __builtin_ctzll(Word);
+					Word &= Word - 1;
+					updateObjPointers((ObjHeader*)(Page + Granule * GRANULE_SIZE));
+				}
+			}
+		}
+	}
+}
+
+/* called in the pause, after marking and before the
+ * pages are queued for sweeping */
+void compactHeap()
+{
+	char *Targets[NUM_CLASSES] = { NULL };
+	char **Candidates = NULL;
+	size_t NumCandidates = 0;
+	size_t MaxCandidates = 0;
+	SegmentList *L;
+	size_t Idx;
+
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		char *Page;
+
+		if (getBigAlloc(Seg))
+		{
+			continue;
+		}
+		for (Page = getDataPtr(Seg); Page < getAllocPtr(Seg); Page += PAGE_SIZE)
+		{
+			PageInfo *Info = getPageInfo(Page);
+			if (Info->Class != NO_CLASS && isEvacuationCandidate(Page))
+			{
+				if (NumCandidates == MaxCandidates)
+				{
+					MaxCandidates = (MaxCandidates == 0) ? 64 : MaxCandidates * 2;
+					Candidates = realloc(Candidates, MaxCandidates * sizeof(char*));
+					if (Candidates == NULL)
+					{
+						printf("Unable to allocate compaction candidates\n");
+						exit(0);
+					}
+				}
+				Candidates[NumCandidates++] = Page;
+			}
+			Info->Flags &= ~PAGE_PINNED;
+		}
+	}
+	if (NumCandidates == 0)
+	{
+		return;
+	}
+
+	for (Idx = 0; Idx < NumCandidates; Idx++)
+	{
+		evacuatePage(Candidates[Idx], Targets);
+	}
+	updateHeapPointers();
+
+	/* the old copies are garbage now */
+	for (Idx = 0; Idx < NumCandidates; Idx++)
+	{
+		char *Page = Candidates[Idx];
+		PageInfo *Info = getPageInfo(Page);
+		unsigned ClassSize = SizeClasses[Info->Class];
+		unsigned Slot;
+		for (Slot = 0; Slot < getNumSlots(Info->Class); Slot++)
+		{
+			ObjHeader *Header = (ObjHeader*)(Page + Slot * ClassSize);
+			if (Header->Status & FORWARDED)
+			{
+				Header->Status = FREE;
+				NumBytesFreed += ClassSize;
+			}
+		}
+	}
+	free(Candidates);
+}
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <pthread.h>
+#include "memory.h"
+#include "heap.h"
+
+#define DEFAULT_RETAIN_MB 8
+/* queued ranges that wake the release thread */
+#define DECOMMIT_BATCH 256
+
+long long NumBytesDecommitted = 0;
+
+/* empty pages kept committed for reuse, up to the
+ * retention budget, linked through PageInfo.Next */
+char *RetainedPages = NULL;
+size_t NumRetainedPages = 0;
+/* decommitted pages, linked through PageInfo.Next */
+char *FreePages = NULL;
+
+/* decommitted runs of big-object pages, sorted by address
+ * and coalesced, reused best-fit before the segments grow */
+typedef struct BigRun
+{
+	char *Start;
+	size_t Size;
+	struct BigRun *Next;
+} BigRun;
+static BigRun *FreeRuns = NULL;
+
+/* a range of empty pages waiting to be returned to the OS */
+typedef struct DecommitRange
+{
+	char *Start;
+	size_t Size;
+	/* small pages go to FreePages once decommitted */
+	int IsPages;
+} DecommitRange;
+
+static DecommitRange *DecommitQueue = NULL;
+static size_t NumDecommits = 0;
+static size_t DecommitCapacity = 0;
+static int DecommitRequested = 0;
+static pthread_mutex_t DecommitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t DecommitReady = PTHREAD_COND_INITIALIZER;
+static pthread_t DecommitThread;
+
+/* Zero asks for pages that read as zeros when they are
+ * touched again, which MADV_FREE doesn't promise.
+ */
+static void reclaimMemory(void *Ptr, size_t Size, int Zero)
+{
+	assert((Size % PAGE_SIZE) == 0);
+	assert(((ulong64)Ptr & (PAGE_SIZE-1)) == 0);
+	
+	int Ret = mprotect(Ptr, Size, PROT_NONE);
+	if (Ret == -1)
+	{
+		printf("unable to mprotect %s():%d\n", __func__, __LINE__);
+		exit(0);
+	}
+#ifdef MADV_FREE
+	/* lazily freed by the kernel, under memory pressure */
+	Ret = Zero ? -1 : madvise(Ptr, Size, MADV_FREE);
+	if (Ret == -1)
+	{
+		Ret = madvise(Ptr, Size, MADV_DONTNEED);
+	}
+#else
+	Ret = madvise(Ptr, Size, MADV_DONTNEED);
+#endif
+	if (Ret == -1)
+	{
+		printf("unable to reclaim physical page %s():%d\n", __func__, __LINE__);
+		exit(0);
+	}
+}
+
+/* The empty pages are returned to the OS in batches, off
+ * the sweep path: SAFEGC_BACKGROUND_DECOMMIT=0 releases them at
+ * the end of each collection instead of on a background thread.
+ */
+static int useDecommitThread()
+{
+	static int DecommitThreadOn = -1;
+
+	if (DecommitThreadOn == -1)
+	{
+		char *Env = getenv("SAFEGC_BACKGROUND_DECOMMIT");
+		DecommitThreadOn = (Env == NULL || atoi(Env) != 0);
+	}
+	return DecommitThreadOn;
+}
+
+/* number of empty pages kept committed (SAFEGC_RETAIN_MB) */
+static size_t getRetainLimit()
+{
+	static size_t RetainLimit = (size_t)-1;
+
+	if (RetainLimit == (size_t)-1)
+	{
+		char *Env = getenv("SAFEGC_RETAIN_MB");
+		size_t RetainMB = DEFAULT_RETAIN_MB;
+		if (Env != NULL && atoi(Env) >= 0)
+		{
+			RetainMB = atoi(Env);
+		}
+		RetainLimit = (RetainMB << 20) / PAGE_SIZE;
+	}
+	return RetainLimit;
+}
+
+static void wakeDecommitThread();
+
+void queueDecommit(char *Start, size_t Size, int IsPages)
+{
+	pthread_mutex_lock(&DecommitLock);
+	if (NumDecommits == DecommitCapacity)
+	{
+		size_t NewCapacity = (DecommitCapacity == 0) ? DECOMMIT_BATCH : DecommitCapacity * 2;
+		DecommitRange *NewQueue = realloc(DecommitQueue, NewCapacity * sizeof(DecommitRange));
+		if (NewQueue == NULL)
+		{
+			printf("Unable to allocate decommit queue\n");
+			exit(0);
+		}
+		DecommitQueue = NewQueue;
+		DecommitCapacity = NewCapacity;
+	}
+	DecommitQueue[NumDecommits].Start = Start;
+	DecommitQueue[NumDecommits].Size = Size;
+	DecommitQueue[NumDecommits].IsPages = IsPages;
+	NumDecommits++;
+	int Full = (NumDecommits % DECOMMIT_BATCH) == 0;
+	pthread_mutex_unlock(&DecommitLock);
+
+	if (Full && useDecommitThread())
+	{
+		wakeDecommitThread();
+	}
+}
+
+/* keep an empty page for reuse by any size class, and
+ * return it to the OS once the retention budget is used */
+void releasePage(char *Page)
+{
+	PageInfo *Info = getPageInfo(Page);
+	assert((Info->Flags & PAGE_LISTED) == 0);
+	Info->FreeList = NULL;
+	Info->NumFree = 0;
+	Info->Class = NO_CLASS;
+	if (NumRetainedPages < getRetainLimit())
+	{
+		NumRetainedPages++;
+		Info->Next = RetainedPages;
+		RetainedPages = Page;
+		return;
+	}
+	queueDecommit(Page, PAGE_SIZE, 1);
+}
+
+static int compareRanges(const void *A, const void *B)
+{
+	const DecommitRange *RA = A;
+	const DecommitRange *RB = B;
+	if (RA->Start == RB->Start)
+	{
+		return 0;
+	}
+	return (RA->Start < RB->Start) ? -1 : 1;
+}
+
+/* add a decommitted run to the free runs, merging it with
+ * its neighbours in the same segment */
+static void insertFreeRun(char *Start, size_t Size)
+{
+	BigRun *Prev = NULL;
+	BigRun *Next = FreeRuns;
+
+	while (Next != NULL && Next->Start < Start)
+	{
+		Prev = Next;
+		Next = Next->Next;
+	}
+	assert(Next == NULL || Start + Size <= Next->Start);
+	if (Prev != NULL && Prev->Start + Prev->Size == Start
+		&& ADDR_TO_SEGMENT(Prev->Start) == ADDR_TO_SEGMENT(Start))
+	{
+		Prev->Size += Size;
+	}
+	else
+	{
+		BigRun *Run = malloc(sizeof(BigRun));
+		if (Run == NULL)
+		{
+			printf("Unable to allocate free run\n");
+			exit(0);
+		}
+		Run->Start = Start;
+		Run->Size = Size;
+		Run->Next = Next;
+		if (Prev != NULL)
+		{
+			Prev->Next = Run;
+		}
+		else
+		{
+			FreeRuns = Run;
+		}
+		Prev = Run;
+	}
+	if (Next != NULL && Prev->Start + Prev->Size == Next->Start
+		&& ADDR_TO_SEGMENT(Prev->Start) == ADDR_TO_SEGMENT(Next->Start))
+	{
+		Prev->Size += Next->Size;
+		Prev->Next = Next->Next;
+		free(Next);
+	}
+}
+
+/* carve Size bytes off the smallest free run that fits */
+char* takeFreeRun(size_t Size)
+{
+	BigRun **Best = NULL;
+	BigRun **Iter;
+
+	for (Iter = &FreeRuns; *Iter != NULL; Iter = &(*Iter)->Next)
+	{
+		if ((*Iter)->Size >= Size && (Best == NULL || (*Iter)->Size < (*Best)->Size))
+		{
+			Best = Iter;
+			if ((*Iter)->Size == Size)
+			{
+				break;
+			}
+		}
+	}
+	if (Best == NULL)
+	{
+		return NULL;
+	}
+	BigRun *Run = *Best;
+	char *Start = Run->Start;
+	Run->Start += Size;
+	Run->Size -= Size;
+	if (Run->Size == 0)
+	{
+		*Best = Run->Next;
+		free(Run);
+	}
+	return Start;
+}
+
+/* Return the queued ranges to the OS, merging the adjacent
+ * ones so that each contiguous run costs one mprotect and one
+ * madvise. The queued pages belong to no list, so the system
+ * calls don't need the heap lock; HeapLocked tells whether the
+ * caller holds it.
+ */
+static void releaseDecommitQueue(int HeapLocked)
+{
+	pthread_mutex_lock(&DecommitLock);
+	DecommitRange *Ranges = DecommitQueue;
+	size_t Num = NumDecommits;
+	DecommitQueue = NULL;
+	NumDecommits = 0;
+	DecommitCapacity = 0;
+	pthread_mutex_unlock(&DecommitLock);
+
+	if (Num == 0)
+	{
+		free(Ranges);
+		return;
+	}
+	long long Start = getTimeNs();
+	qsort(Ranges, Num, sizeof(DecommitRange), compareRanges);
+	size_t Out = 0;
+	size_t Idx;
+	for (Idx = 0; Idx < Num; Idx++)
+	{
+		if (Out > 0 && Ranges[Out-1].IsPages == Ranges[Idx].IsPages
+			&& Ranges[Out-1].Start + Ranges[Out-1].Size == Ranges[Idx].Start)
+		{
+			Ranges[Out-1].Size += Ranges[Idx].Size;
+		}
+		else
+		{
+			Ranges[Out++] = Ranges[Idx];
+		}
+	}
+	for (Idx = 0; Idx < Out; Idx++)
+	{
+		reclaimMemory(Ranges[Idx].Start, Ranges[Idx].Size, !Ranges[Idx].IsPages);
+		__atomic_fetch_add(&NumBytesDecommitted, Ranges[Idx].Size, __ATOMIC_RELAXED);
+	}
+
+	if (!HeapLocked)
+	{
+		lockHeap();
+	}
+	endPhase(GC_PHASE_DECOMMIT, Start);
+	for (Idx = 0; Idx < Out; Idx++)
+	{
+		char *Page;
+		if (!Ranges[Idx].IsPages)
+		{
+			insertFreeRun(Ranges[Idx].Start, Ranges[Idx].Size);
+			continue;
+		}
+		for (Page = Ranges[Idx].Start; Page < Ranges[Idx].Start + Ranges[Idx].Size; Page += PAGE_SIZE)
+		{
+			PageInfo *Info = getPageInfo(Page);
+			Info->Next = FreePages;
+			FreePages = Page;
+		}
+	}
+	if (!HeapLocked)
+	{
+		unlockHeap();
+	}
+	free(Ranges);
+}
+
+static void* decommitThread(void *Arg)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&DecommitLock);
+		while (!DecommitRequested)
+		{
+			pthread_cond_wait(&DecommitReady, &DecommitLock);
+		}
+		DecommitRequested = 0;
+		pthread_mutex_unlock(&DecommitLock);
+
+		releaseDecommitQueue(0);
+	}
+	return NULL;
+}
+
+static void wakeDecommitThread()
+{
+	static int ThreadStarted = 0;
+
+	pthread_mutex_lock(&DecommitLock);
+	if (!ThreadStarted)
+	{
+		if (createThread(&DecommitThread, decommitThread, NULL) != 0)
+		{
+			printf("Unable to create decommit thread\n");
+			exit(0);
+		}
+		ThreadStarted = 1;
+	}
+	DecommitRequested = 1;
+	pthread_cond_signal(&DecommitReady);
+	pthread_mutex_unlock(&DecommitLock);
+}
+
+/* called at the end of a collection, with the heap lock held */
+void scheduleDecommit()
+{
+	if (useDecommitThread())
+	{
+		wakeDecommitThread();
+	}
+	else
+	{
+		releaseDecommitQueue(1);
+	}
+}
@@ -0,0 +1,560 @@
+#ifndef __HEAP_H
+#define __HEAP_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "memory.h"
+#include "objheader.h"
+
+/* Interface between the parts of the runtime: memory.c
+ * (segments, pages and allocation), mark.c, sweep.c, compact.c,
+ * decommit.c, collect.c (safepoints and the collection cycles),
+ * telemetry.c and profile.c. Programs use memory.h; support.c
+ * gets the flags that the write barriers test and the calls
+ * they make into the collector.
+ */
+
+typedef unsigned long long ulong64;
+
+#define SEGMENT_SHIFT 34
+#define SEGMENT_SIZE (1ULL << SEGMENT_SHIFT)
+/* user addresses on x86-64 have 47 bits */
+#define NUM_SEGMENT_SLOTS (1ULL << (47 - SEGMENT_SHIFT))
+#define PAGE_SIZE 4096
+#define NUM_PAGES_IN_SEG (SEGMENT_SIZE/PAGE_SIZE)
+#define HUGE_PAGE_SIZE (2ULL << 20)
+/* the data area starts on a huge page boundary */
+#define METADATA_SIZE Align(sizeof(struct Segment), HUGE_PAGE_SIZE)
+#define OTHER_METADATA_SIZE ((METADATA_SIZE/PAGE_SIZE) * 2)
+/* larger objects get pages of their own */
+#define MAX_SMALL_SIZE PAGE_SIZE
+#define Align(x, y) (((x) + (y-1)) & ~(y-1))
+#define ADDR_TO_PAGE(x) (char*)(((ulong64)(x)) & ~(PAGE_SIZE-1))
+#define ADDR_TO_SEGMENT(x) (Segment*)(((ulong64)(x)) & ~(SEGMENT_SIZE-1))
+#define FREE 1
+#define TYPED 2
+/* moved by the compaction, the payload holds the new address */
+#define FORWARDED 4
+#define GRANULE_SIZE 8
+#define NUM_MARK_WORDS (SEGMENT_SIZE/GRANULE_SIZE/64)
+#define PAGE_MARK_WORDS (PAGE_SIZE/GRANULE_SIZE/64)
+#define NUM_SIZE_CLASSES 22
+/* objects of up to 32 bytes go to pages without object
+ * headers, whatever their type */
+#define NUM_HEADERLESS_CLASSES 4
+#define FIRST_HEADERLESS_CLASS (NUM_SIZE_CLASSES * 2)
+#define MAX_HEADERLESS_SIZE 32
+/* every size class has a second set of pages for
+ * pointer-free objects */
+#define NUM_CLASSES (NUM_SIZE_CLASSES * 2 + NUM_HEADERLESS_CLASSES)
+/* type indexes of headerless objects: zero is untyped and
+ * one is typed without pointers */
+#define UNTYPED_INDEX 0
+#define POINTER_FREE_INDEX 1
+#define NO_CLASS 0xff
+#define PAGE_LISTED 1
+#define PAGE_SKIP_SWEEP 2
+#define PAGE_NURSERY 4
+#define PAGE_SWEEPING 8
+/* referenced conservatively during a compacting GC */
+#define PAGE_PINNED 16
+#define SATB_BUFFER_SIZE 256
+#define CARD_SIZE 512
+#define NUM_CARDS (SEGMENT_SIZE/CARD_SIZE)
+
+struct OtherMetadata
+{
+	char *AllocPtr;
+	char *CommitPtr;
+	char *ReservePtr;
+	char *DataPtr;
+	char *SweepPtr;
+	char *SweepLimit;
+	int BigAlloc;
+};
+
+/* Pages of small segments hold objects of a single
+ * size class. Free slots are linked through their
+ * payload. A page is LISTED while it is the current
+ * allocation page of its class or on the partial list,
+ * and belongs to the NURSERY if objects were allocated
+ * on it since it was last swept.
+ */
+typedef struct PageInfo
+{
+	char *FreeList;
+	char *Next;
+	unsigned short NumFree;
+	unsigned char Class;
+	unsigned char Flags;
+} PageInfo;
+
+typedef struct Segment
+{
+	union
+	{
+		unsigned short Size[NUM_PAGES_IN_SEG];
+		struct OtherMetadata Other;
+	};
+	/* small segments only */
+	PageInfo Pages[NUM_PAGES_IN_SEG];
+	/* one mark bit per granule, set for object headers
+	 * and the slots of headerless objects. Big objects
+	 * start on a page, so big segments have one per page. */
+	ulong64 MarkBits[NUM_MARK_WORDS];
+	/* one byte per card, set by the write barrier */
+	unsigned char Cards[NUM_CARDS];
+} Segment;
+
+typedef struct SegmentList
+{
+	struct Segment *Segment;
+	struct SegmentList *Next;
+} SegmentList;
+
+/* pointers overwritten during a concurrent mark */
+typedef struct SatbBuffer
+{
+	struct SatbBuffer *Next;
+	unsigned Count;
+	void *Entries[SATB_BUFFER_SIZE];
+} SatbBuffer;
+
+/* Per-thread allocation buffer. A thread owns one page
+ * per size class and allocates from a private list of its
+ * free slots without locking. Objects freed into an owned
+ * page go to the free list of the page, which the owner
+ * picks up on refill.
+ */
+typedef struct ThreadCache
+{
+	char *FreeLists[NUM_CLASSES];
+	char *Pages[NUM_CLASSES];
+	long long NumBytesAllocated;
+	size_t AllocSinceFlush;
+	/* bytes to allocate before the next sample */
+	long long SampleBytesLeft;
+	ulong64 SampleSeed;
+	/* stack range to scan while the thread is parked */
+	unsigned *StackTop;
+	unsigned *StackBottom;
+	int Parked;
+	/* argument of a created thread until it starts */
+	void *StartArg;
+	SatbBuffer *Satb;
+	struct ThreadCache *Next;
+} ThreadCache;
+
+/* defined by the programs that MemSafe gave write barriers */
+extern int SafeGCWriteBarriers __attribute__((weak));
+
+/* memory.c */
+extern SegmentList *Segments;
+extern char *HeapStart;
+extern char *HeapEnd;
+extern Segment **SegmentTable;
+extern const unsigned SizeClasses[NUM_CLASSES];
+extern const unsigned HeaderlessSlots[NUM_HEADERLESS_CLASSES];
+extern const unsigned HeaderlessFirstSlot[NUM_HEADERLESS_CLASSES];
+extern ulong64 *TypeTable;
+extern ThreadCache *ThreadCaches;
+extern __thread ThreadCache *MyCache;
+extern char *PartialPages[NUM_CLASSES];
+extern long long NumBytesFreed;
+extern long long NumBytesAllocated;
+extern long long NumBigRunsReused;
+
+void lockHeap();
+void unlockHeap();
+void listPage(char *Page);
+char* createPage(unsigned Class);
+void returnPage(ThreadCache *TC, unsigned Class);
+void freeObj(void *Ptr);
+unsigned* getStackBottom();
+ThreadCache* getThreadCache();
+int createThread(pthread_t *Thread, void *(*Fn)(void*), void *Arg);
+int IsTyped(void *Obj);
+void* GetObjBase(void *Ptr);
+
+/* decommit.c */
+extern char *RetainedPages;
+extern size_t NumRetainedPages;
+extern char *FreePages;
+extern long long NumBytesDecommitted;
+
+void queueDecommit(char *Start, size_t Size, int IsPages);
+void releasePage(char *Page);
+char* takeFreeRun(size_t Size);
+void scheduleDecommit();
+
+/* mark.c */
+extern int PinningActive;
+extern long long MarkTimeNs;
+
+void clearMarks();
+void markRoots();
+void markRootChunks();
+void markHeap();
+void markPtr(void *Ptr);
+void resetMarkedBytes();
+size_t getMarkedBytes();
+size_t getMarkedObjects();
+void dirtyCards(void *Slot, size_t Size);
+void clearCards();
+void markDirtyCards();
+
+/* sweep.c */
+extern long long NumPagesSweptEagerly;
+extern long long NumPagesSweptLazily;
+extern long long NumPagesSweptInBackground;
+
+int isUnswept(char *Page);
+void lazySweep(size_t NumPages);
+void publishSweptPages();
+void finishBackgroundSweeps();
+void queueUnsweptPages(int Minor);
+void sweep();
+
+/* compact.c */
+extern long long NumPagesEvacuated;
+extern long long NumBytesMoved;
+
+int shouldCompact();
+void compactHeap();
+
+/* collect.c */
+extern int SafepointRequested;
+extern int MarkingActive;
+extern int CardMarkingActive;
+extern char *DeferredBigFrees;
+extern long long NumGCTriggered;
+extern long long NumMinorGCs;
+extern size_t LiveBytes;
+extern size_t AllocSinceGC;
+
+int isGenerationalMode();
+int isConcurrentMode();
+void checkAndRunGC(size_t Sz);
+void flushSatbBuffer(ThreadCache *TC);
+void unparkThread(ThreadCache *TC);
+void recordOverwrite(void *Slot, size_t Size);
+
+/* telemetry.c */
+long long getTimeNs();
+void initTelemetry();
+void beginGCEvent(int Kind, size_t HeapBefore);
+void endGCEvent(size_t HeapAfter);
+void endPhase(int Phase, long long Start);
+void recordPause(long long Pause);
+
+/* profile.c */
+void initSampling(ThreadCache *TC);
+void sampleAllocation(ThreadCache *TC, size_t Size, unsigned long long Type);
+
+static inline void setAllocPtr(Segment *Seg, char *Ptr) { Seg->Other.AllocPtr = Ptr; }
+static inline void setCommitPtr(Segment *Seg, char *Ptr) { Seg->Other.CommitPtr = Ptr; }
+static inline void setReservePtr(Segment *Seg, char *Ptr) { Seg->Other.ReservePtr = Ptr; }
+static inline void setDataPtr(Segment *Seg, char *Ptr) { Seg->Other.DataPtr = Ptr; }
+static inline char* getAllocPtr(Segment *Seg) { return Seg->Other.AllocPtr; }
+static inline char* getCommitPtr(Segment *Seg) { return Seg->Other.CommitPtr; }
+static inline char* getReservePtr(Segment *Seg) { return Seg->Other.ReservePtr; }
+static inline char* getDataPtr(Segment *Seg) { return Seg->Other.DataPtr; }
+static inline void setSweepPtr(Segment *Seg, char *Ptr) { Seg->Other.SweepPtr = Ptr; }
+static inline void setSweepLimit(Segment *Seg, char *Ptr) { Seg->Other.SweepLimit = Ptr; }
+static inline char* getSweepPtr(Segment *Seg) { return Seg->Other.SweepPtr; }
+static inline char* getSweepLimit(Segment *Seg) { return Seg->Other.SweepLimit; }
+static inline void setBigAlloc(Segment *Seg, int BigAlloc) { Seg->Other.BigAlloc = BigAlloc; }
+static inline int getBigAlloc(Segment *Seg) { return Seg->Other.BigAlloc; }
+
+static inline unsigned short* getSizeMetadata(char *Ptr)
+{
+	char *Page = ADDR_TO_PAGE(Ptr);
+	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
+	ulong64 PageNo = (Page - (char*)Seg)/ PAGE_SIZE;
+	return &Seg->Size[PageNo];
+}
+
+static inline PageInfo* getPageInfo(char *Ptr)
+{
+	char *Page = ADDR_TO_PAGE(Ptr);
+	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
+	ulong64 PageNo = (Page - (char*)Seg)/ PAGE_SIZE;
+	return &Seg->Pages[PageNo];
+}
+
+static inline int isHeaderlessClass(unsigned Class)
+{
+	return Class != NO_CLASS && Class >= FIRST_HEADERLESS_CLASS;
+}
+
+static inline unsigned getNumSlots(unsigned Class)
+{
+	if (isHeaderlessClass(Class))
+	{
+		return HeaderlessSlots[Class - FIRST_HEADERLESS_CLASS];
+	}
+	return PAGE_SIZE / SizeClasses[Class];
+}
+
+/* offset of the first slot in a page of the class */
+static inline unsigned getFirstSlot(unsigned Class)
+{
+	if (isHeaderlessClass(Class))
+	{
+		return HeaderlessFirstSlot[Class - FIRST_HEADERLESS_CLASS];
+	}
+	return 0;
+}
+
+/* offset of the payload, and of the free list link, in a slot */
+static inline unsigned getSlotHeaderSize(unsigned Class)
+{
+	return isHeaderlessClass(Class) ? 0 : OBJ_HEADER_SIZE;
+}
+
+static inline char* getSlot(char *Page, unsigned Class, unsigned Slot)
+{
+	return Page + getFirstSlot(Class) + Slot * SizeClasses[Class];
+}
+
+/* objects on these pages are marked but never scanned */
+static inline int isPointerFreePage(PageInfo *Info)
+{
+	return Info->Class != NO_CLASS && Info->Class >= NUM_SIZE_CLASSES
+		&& !isHeaderlessClass(Info->Class);
+}
+
+/* Most words scanned are not heap addresses, the range
+ * check filters them out before the table lookup. */
+static inline Segment* findSegment(void *Ptr)
+{
+	char *P = (char*)Ptr;
+
+	if (P < __atomic_load_n(&HeapStart, __ATOMIC_ACQUIRE)
+		|| P >= __atomic_load_n(&HeapEnd, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+	return __atomic_load_n(&SegmentTable[(ulong64)P >> SEGMENT_SHIFT], __ATOMIC_ACQUIRE);
+}
+
+/* Objects on headerless pages are referred to by the address
+ * of their slot, which is also their payload; their free bits
+ * and type indexes live at the start of the page. Objects
+ * outside the heap (the stack copies made by HeapToStack)
+ * always have a header.
+ */
+static inline int isHeaderless(void *Obj)
+{
+	Segment *Seg = findSegment(Obj);
+	return Seg != NULL && !getBigAlloc(Seg) && isHeaderlessClass(getPageInfo(Obj)->Class);
+}
+
+static inline ulong64* getFreeBits(char *Page)
+{
+	return (ulong64*)Page;
+}
+
+static inline unsigned short* getTypeIndexes(char *Page, unsigned Class)
+{
+	return (unsigned short*)(Page + Align(getNumSlots(Class), 64) / 8);
+}
+
+static inline unsigned getSlotIndex(ObjHeader *Header, unsigned Class)
+{
+	char *Page = ADDR_TO_PAGE(Header);
+	return ((char*)Header - Page - getFirstSlot(Class)) / SizeClasses[Class];
+}
+
+static inline ObjHeader* ObjToHeader(void *Obj)
+{
+	if (isHeaderless(Obj))
+	{
+		return (ObjHeader*)Obj;
+	}
+	return (ObjHeader*)((char*)Obj - OBJ_HEADER_SIZE);
+}
+
+static inline char* getObjPayload(ObjHeader *Header)
+{
+	if (isHeaderless(Header))
+	{
+		return (char*)Header;
+	}
+	return (char*)Header + OBJ_HEADER_SIZE;
+}
+
+/* bytes taken by the object, including its header */
+static inline size_t getObjSize(ObjHeader *Header)
+{
+	if (isHeaderless(Header))
+	{
+		return SizeClasses[getPageInfo((char*)Header)->Class];
+	}
+	return Header->Size;
+}
+
+static inline int isObjFree(ObjHeader *Header)
+{
+	if (isHeaderless(Header))
+	{
+		unsigned Class = getPageInfo((char*)Header)->Class;
+		unsigned Slot = getSlotIndex(Header, Class);
+		ulong64 *Bits = getFreeBits(ADDR_TO_PAGE(Header));
+		return (__atomic_load_n(&Bits[Slot / 64], __ATOMIC_RELAXED) >> (Slot % 64)) & 1;
+	}
+	return (Header->Status & FREE) != 0;
+}
+
+/* the free bits of a page are shared by the slots of all
+ * the threads that allocate and free on it */
+static inline void setObjFree(ObjHeader *Header, int Free)
+{
+	if (isHeaderless(Header))
+	{
+		unsigned Class = getPageInfo((char*)Header)->Class;
+		unsigned Slot = getSlotIndex(Header, Class);
+		ulong64 *Bits = getFreeBits(ADDR_TO_PAGE(Header));
+		if (Free)
+		{
+			__atomic_fetch_or(&Bits[Slot / 64], 1ULL << (Slot % 64), __ATOMIC_RELAXED);
+		}
+		else
+		{
+			__atomic_fetch_and(&Bits[Slot / 64], ~(1ULL << (Slot % 64)), __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	Header->Status = Free ? FREE : 0;
+}
+
+/* returns nonzero if the object is typed, along with its type */
+static inline int getObjType(ObjHeader *Header, ulong64 *Type)
+{
+	if (isHeaderless(Header))
+	{
+		unsigned Class = getPageInfo((char*)Header)->Class;
+		unsigned short *Indexes = getTypeIndexes(ADDR_TO_PAGE(Header), Class);
+		unsigned short Idx = __atomic_load_n(&Indexes[getSlotIndex(Header, Class)], __ATOMIC_ACQUIRE);
+		*Type = (Idx == UNTYPED_INDEX) ? 0 : TypeTable[Idx];
+		return Idx != UNTYPED_INDEX;
+	}
+	*Type = Header->Type;
+	return (__atomic_load_n(&Header->Status, __ATOMIC_ACQUIRE) & TYPED) != 0;
+}
+
+/* headerless pages are never evacuated */
+static inline int isObjForwarded(ObjHeader *Header)
+{
+	return !isHeaderless(Header) && (Header->Status & FORWARDED);
+}
+
+/* returns the header of the allocated object that
+ * contains Ptr, or NULL if Ptr is not an object address.
+ * Small objects live in fixed size slots, so the header
+ * is found from the size class of the page; a headerless
+ * object is known by its slot. The first page of a big allocation
+ * has its metadata set to one and the remaining pages zero.
+ */
+static inline ObjHeader* findObjHeader(void *Ptr)
+{
+	Segment *Seg = findSegment(Ptr);
+	char *P = (char*)Ptr;
+
+	if (Seg == NULL || P < getDataPtr(Seg) || P >= getAllocPtr(Seg))
+	{
+		return NULL;
+	}
+
+	char *Page = ADDR_TO_PAGE(P);
+	unsigned short *SzMeta = getSizeMetadata(Page);
+	ObjHeader *Header;
+
+	if (getBigAlloc(Seg))
+	{
+		while (SzMeta[0] == 0 && Page > getDataPtr(Seg))
+		{
+			Page -= PAGE_SIZE;
+			SzMeta--;
+		}
+		if (SzMeta[0] != 1)
+		{
+			return NULL;
+		}
+		Header = (ObjHeader*)Page;
+	}
+	else
+	{
+		PageInfo *Info = getPageInfo(Page);
+		if (Info->Class == NO_CLASS)
+		{
+			/* page is already reclaimed */
+			return NULL;
+		}
+		unsigned Class = Info->Class;
+		unsigned First = getFirstSlot(Class);
+		if (P < Page + First)
+		{
+			return NULL;
+		}
+		unsigned Slot = (P - Page - First) / SizeClasses[Class];
+		if (Slot >= getNumSlots(Class))
+		{
+			return NULL;
+		}
+		Header = (ObjHeader*)getSlot(Page, Class, Slot);
+		if (isHeaderlessClass(Class))
+		{
+			ulong64 Bits = __atomic_load_n(&getFreeBits(Page)[Slot / 64], __ATOMIC_RELAXED);
+			return ((Bits >> (Slot % 64)) & 1) ? NULL : Header;
+		}
+	}
+
+	if ((Header->Status & FREE) || P < (char*)Header + OBJ_HEADER_SIZE
+		|| P >= (char*)Header + Header->Size)
+	{
+		return NULL;
+	}
+	return Header;
+}
+
+static inline ulong64* getMarkWord(void *Ptr, ulong64 *Bit)
+{
+	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
+	ulong64 Unit = getBigAlloc(Seg) ? PAGE_SIZE : GRANULE_SIZE;
+	ulong64 Idx = ((char*)Ptr - (char*)Seg) / Unit;
+	*Bit = 1ULL << (Idx % 64);
+	return &Seg->MarkBits[Idx / 64];
+}
+
+static inline int isMarked(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getMarkWord(Header, &Bit);
+	return (*Word & Bit) != 0;
+}
+
+/* returns zero if the object was already marked. Mark
+ * threads race for the bit, so it is set with fetch-or. */
+static inline int setMark(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getMarkWord(Header, &Bit);
+	if (__atomic_load_n(Word, __ATOMIC_RELAXED) & Bit)
+	{
+		return 0;
+	}
+	return (__atomic_fetch_or(Word, Bit, __ATOMIC_RELAXED) & Bit) == 0;
+}
+
+static inline void clearMark(ObjHeader *Header)
+{
+	ulong64 Bit;
+	ulong64 *Word = getMarkWord(Header, &Bit);
+	if (__atomic_load_n(Word, __ATOMIC_RELAXED) & Bit)
+	{
+		__atomic_fetch_and(Word, ~Bit, __ATOMIC_RELAXED);
+	}
+}
+
+#endif
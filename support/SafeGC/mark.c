@@ -0,0 +1,923 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include "memory.h"
+#include "heap.h"
+#include "marker.h"
+
+#define PATH_SZ 128
+#define MARK_DEQUE_SIZE (1ULL << 20)
+#define MAX_MARK_THREADS 64
+#define ROOT_CHUNK_SIZE (64 << 10)
+#define STEAL_ATTEMPTS 16
+#define PREFETCH_DEPTH 8
+
+long long MarkTimeNs = 0;
+extern char  etext, edata, end;
+
+/* Chase-Lev work-stealing deque of objects that are
+ * marked but not yet scanned. The owner pushes and takes
+ * at the bottom, other mark threads steal from the top.
+ * When a deque is full, the object is dropped and the
+ * MarkOverflow flag makes the collector rescan the heap
+ * for marked objects instead.
+ */
+typedef struct MarkDeque
+{
+	long Top;
+	char Pad[56];
+	long Bottom;
+	ObjHeader **Buf;
+} MarkDeque;
+
+typedef struct MarkWorker
+{
+	MarkDeque Deque;
+	unsigned Seed;
+	size_t MarkedBytes;
+	size_t MarkedObjects;
+	pthread_t Thread;
+} MarkWorker;
+
+/* [Start, End) slice of a root range */
+typedef struct RootChunk
+{
+	unsigned *Start;
+	unsigned *End;
+} RootChunk;
+
+static MarkWorker MarkWorkers[MAX_MARK_THREADS];
+static unsigned NumMarkThreads = 0;
+static RootChunk *RootChunks = NULL;
+static unsigned NumRootChunks = 0;
+static unsigned MaxRootChunks = 0;
+static unsigned NextRootChunk;
+static int RescanTask;
+static int MarkOverflow;
+static unsigned NumIdleWorkers;
+
+static pthread_mutex_t MarkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t MarkStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t MarkDone = PTHREAD_COND_INITIALIZER;
+static unsigned MarkEpoch = 0;
+static unsigned NumWorkersDone;
+
+static void pushObj(MarkWorker *W, ObjHeader *Header)
+{
+	MarkDeque *D = &W->Deque;
+	long Bottom = __atomic_load_n(&D->Bottom, __ATOMIC_RELAXED);
+	long Top = __atomic_load_n(&D->Top, __ATOMIC_ACQUIRE);
+
+	if (Bottom - Top >= (long)MARK_DEQUE_SIZE - 1)
+	{
+		__atomic_store_n(&MarkOverflow, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n(&D->Buf[Bottom & (MARK_DEQUE_SIZE-1)], Header, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&D->Bottom, Bottom + 1, __ATOMIC_RELAXED);
+}
+
+/* owner end of the deque, returns NULL when it is empty */
+static ObjHeader* takeObj(MarkWorker *W)
+{
+	MarkDeque *D = &W->Deque;
+	long Bottom = __atomic_load_n(&D->Bottom, __ATOMIC_RELAXED) - 1;
+	ObjHeader *Header = NULL;
+
+	__atomic_store_n(&D->Bottom, Bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long Top = __atomic_load_n(&D->Top, __ATOMIC_RELAXED);
+
+	if (Top <= Bottom)
+	{
+		Header = __atomic_load_n(&D->Buf[Bottom & (MARK_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+		if (Top == Bottom)
+		{
+			/* last object: race with the thieves for it */
+			if (!__atomic_compare_exchange_n(&D->Top, &Top, Top + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			{
+				Header = NULL;
+			}
+			__atomic_store_n(&D->Bottom, Bottom + 1, __ATOMIC_RELAXED);
+		}
+	}
+	else
+	{
+		__atomic_store_n(&D->Bottom, Bottom + 1, __ATOMIC_RELAXED);
+	}
+	return Header;
+}
+
+/* thief end of the deque, returns NULL when it is empty
+ * or another thread won the race for the top object */
+static ObjHeader* stealObj(MarkWorker *Victim)
+{
+	MarkDeque *D = &Victim->Deque;
+	long Top = __atomic_load_n(&D->Top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long Bottom = __atomic_load_n(&D->Bottom, __ATOMIC_ACQUIRE);
+
+	if (Top >= Bottom)
+	{
+		return NULL;
+	}
+	ObjHeader *Header = __atomic_load_n(&D->Buf[Top & (MARK_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&D->Top, &Top, Top + 1, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	{
+		return NULL;
+	}
+	return Header;
+}
+
+static int isDequeEmpty(MarkWorker *W)
+{
+	return __atomic_load_n(&W->Deque.Top, __ATOMIC_ACQUIRE)
+		>= __atomic_load_n(&W->Deque.Bottom, __ATOMIC_ACQUIRE);
+}
+
+/* reset the mark bits of all allocated pages */
+void clearMarks()
+{
+	SegmentList *L;
+
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		ulong64 Bit;
+		if (getAllocPtr(Seg) == getDataPtr(Seg))
+		{
+			continue;
+		}
+		/* the last word is partly allocated in big segments */
+		ulong64 *Start = getMarkWord(getDataPtr(Seg), &Bit);
+		ulong64 *End = getMarkWord(getAllocPtr(Seg) - 1, &Bit) + 1;
+		memset(Start, 0, (End - Start) * sizeof(ulong64));
+	}
+}
+
+/* set while the marking of a compacting GC runs */
+int PinningActive = 0;
+
+static void markHeader(MarkWorker *W, ObjHeader *Header)
+{
+	if (Header == NULL || !setMark(Header))
+	{
+		return;
+	}
+	ulong64 Type;
+	W->MarkedBytes += getObjSize(Header);
+	W->MarkedObjects++;
+	if (getObjType(Header, &Type) && Type == 0 && !PinningActive)
+	{
+		/* holds no pointers */
+		return;
+	}
+	pushObj(W, Header);
+}
+
+static void markObj(MarkWorker *W, void *Ptr)
+{
+	markHeader(W, findObjHeader(Ptr));
+}
+
+/* A word that may or may not be a pointer can't be updated,
+ * so the compaction leaves the page of its target in place. */
+static void pinObj(ObjHeader *Header)
+{
+	if (Header != NULL && !getBigAlloc(ADDR_TO_SEGMENT(Header)))
+	{
+		PageInfo *Info = getPageInfo(ADDR_TO_PAGE(Header));
+		if ((__atomic_load_n(&Info->Flags, __ATOMIC_RELAXED) & PAGE_PINNED) == 0)
+		{
+			__atomic_fetch_or(&Info->Flags, PAGE_PINNED, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void markConservative(MarkWorker *W, void *Ptr)
+{
+	ObjHeader *Header = findObjHeader(Ptr);
+	if (PinningActive)
+	{
+		pinObj(Header);
+	}
+	markHeader(W, Header);
+}
+
+/* walk all 4-byte aligned addresses in [Start, End) */
+static void scanRange(MarkWorker *W, unsigned *Start, unsigned *End)
+{
+	unsigned *Cur;
+	for (Cur = Start; Cur < End; Cur++)
+	{
+		markConservative(W, *(void**)Cur);
+	}
+}
+
+/* With SAFEGC_ROOT_ALIGN=8 the roots are scanned at 8-byte
+ * granularity: the compiler keeps pointers in globals and stack
+ * slots 8-byte aligned on x86-64.
+ */
+static unsigned getRootAlign()
+{
+	static unsigned RootAlign = 0;
+
+	if (RootAlign == 0)
+	{
+		char *Env = getenv("SAFEGC_ROOT_ALIGN");
+		RootAlign = (Env != NULL && atoi(Env) == 8) ? 8 : 4;
+	}
+	return RootAlign;
+}
+
+static void scanRootRange(MarkWorker *W, unsigned *Start, unsigned *End)
+{
+	unsigned Step = getRootAlign() / sizeof(unsigned);
+	unsigned *Cur;
+	for (Cur = Start; Cur < End; Cur += Step)
+	{
+		markConservative(W, *(void**)Cur);
+	}
+}
+
+/* Visit the possible pointers of an object that start in
+ * [Lo, Hi). Objects without a type are scanned conservatively.
+ * The type bitmap of a typed object has one bit per pointer
+ * slot of an element, below the terminating bit at the number
+ * of slots; it repeats for arrays of elements. Whatever follows
+ * the last whole element (a malloc(sizeof(T) + N) tail) has no
+ * known layout and is scanned conservatively. Objects typed
+ * with a zero bitmap hold no pointers.
+ * The other words of a typed object may still hold addresses,
+ * as integers or in slots the type misses. They are not traced,
+ * but in a compacting GC what they point to must not move.
+ */
+static void scanObjRange(MarkWorker *W, ObjHeader *Header, char *Lo, char *Hi)
+{
+	char *Start = getObjPayload(Header);
+	char *End = (char*)Header + getObjSize(Header);
+	ulong64 Type;
+
+	Lo = (Lo > Start) ? Lo : Start;
+	Hi = (Hi < End) ? Hi : End;
+	if (!getObjType(Header, &Type))
+	{
+		End -= sizeof(void*) - 1;
+		scanRange(W, (unsigned*)Lo, (unsigned*)((Hi < End) ? Hi : End));
+		return;
+	}
+
+	void **Slots = (void**)Start;
+	size_t First = (Lo - Start) / sizeof(void*);
+	size_t Last = (Hi - Start) / sizeof(void*);
+	size_t Base;
+	size_t Idx;
+
+	if (Type == 0)
+	{
+		for (Idx = First; PinningActive && Idx < Last; Idx++)
+		{
+			pinObj(findObjHeader(Slots[Idx]));
+		}
+		return;
+	}
+	unsigned NumSlots = 63 - __builtin_clzll(Type);
+	ulong64 PtrSlots = Type & ~(1ULL << NumSlots);
+	size_t Whole = (End - Start) / sizeof(void*) / NumSlots * NumSlots;
+
+	if ((char*)&Slots[Whole] < Hi)
+	{
+		char *Tail = (char*)&Slots[Whole];
+		End -= sizeof(void*) - 1;
+		scanRange(W, (unsigned*)((Lo > Tail) ? Lo : Tail), (unsigned*)((Hi < End) ? Hi : End));
+	}
+	Last = (Last < Whole) ? Last : Whole;
+	for (Idx = First; PinningActive && Idx < Last; Idx++)
+	{
+		if (((PtrSlots >> (Idx % NumSlots)) & 1) == 0)
+		{
+			pinObj(findObjHeader(Slots[Idx]));
+		}
+	}
+	if (PtrSlots == 0)
+	{
+		return;
+	}
+	for (Base = First - First % NumSlots; Base < Last; Base += NumSlots)
+	{
+		ulong64 Bits = PtrSlots;
+		while (Bits != 0)
+		{
+			Idx = Base + __builtin_ctzll(Bits);
+			Bits &= Bits - 1;
+			if (Idx >= Last)
+			{
+				break;
+			}
+			if (Idx >= First)
+			{
+				markObj(W, Slots[Idx]);
+			}
+		}
+	}
+}
+
+static void scanObj(MarkWorker *W, ObjHeader *Header)
+{
+	scanObjRange(W, Header, getObjPayload(Header), (char*)Header + getObjSize(Header));
+}
+
+/* recover from a deque overflow by scanning
+ * every marked object in the heap again.
+ */
+static void rescanMarkedObjects(MarkWorker *W)
+{
+	SegmentList *L;
+
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		char *Page;
+
+		for (Page = getDataPtr(Seg); Page < getAllocPtr(Seg); Page += PAGE_SIZE)
+		{
+			if (getBigAlloc(Seg))
+			{
+				ObjHeader *Header = (ObjHeader*)Page;
+				if (getSizeMetadata(Page)[0] == 1 && isMarked(Header))
+				{
+					scanObj(W, Header);
+				}
+				continue;
+			}
+			PageInfo *Info = getPageInfo(Page);
+			if (Info->Class == NO_CLASS || isPointerFreePage(Info))
+			{
+				continue;
+			}
+			ulong64 Bit;
+			ulong64 *Words = getMarkWord(Page, &Bit);
+			unsigned Idx;
+			for (Idx = 0; Idx < PAGE_MARK_WORDS; Idx++)
+			{
+				ulong64 Word = Words[Idx];
+				while (Word != 0)
+				{
+					unsigned Granule = Idx * 64 + __builtin_ctzll(Word);
+					Word &= Word - 1;
+					scanObj(W, (ObjHeader*)(Page + Granule * GRANULE_SIZE));
+				}
+			}
+		}
+	}
+}
+
+/* Write barrier slow path in generational mode: dirty the
+ * cards of the Size bytes at Slot, so that the next minor
+ * collection scans the old objects there for pointers to
+ * new ones.
+ */
+void dirtyCards(void *Slot, size_t Size)
+{
+	Segment *Seg = findSegment(Slot);
+	if (Seg == NULL || Size == 0)
+	{
+		return;
+	}
+	ulong64 Card = ((char*)Slot - (char*)Seg) / CARD_SIZE;
+	ulong64 Last = ((char*)Slot + Size - 1 - (char*)Seg) / CARD_SIZE;
+	for (; Card <= Last; Card++)
+	{
+		Seg->Cards[Card] = 1;
+	}
+}
+
+void clearCards()
+{
+	SegmentList *L;
+
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		ulong64 Start = (getDataPtr(Seg) - (char*)Seg) / CARD_SIZE;
+		ulong64 End = (getAllocPtr(Seg) - (char*)Seg) / CARD_SIZE;
+		memset(&Seg->Cards[Start], 0, End - Start);
+	}
+}
+
+/* scan the part of an old object that lies on a card */
+static void scanCardRange(MarkWorker *W, ObjHeader *Header, char *Card)
+{
+	if (isObjFree(Header) || !isMarked(Header))
+	{
+		return;
+	}
+	scanObjRange(W, Header, Card, Card + CARD_SIZE);
+}
+
+/* Mark the objects that old objects on dirty cards point to,
+ * and clean the cards. Every object is old once the
+ * collection is over, so no card stays dirty.
+ */
+static void scanDirtyCards(MarkWorker *W)
+{
+	SegmentList *L;
+
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		char *Card;
+
+		for (Card = getDataPtr(Seg); Card < getAllocPtr(Seg); Card += CARD_SIZE)
+		{
+			unsigned char *Dirty = &Seg->Cards[(Card - (char*)Seg) / CARD_SIZE];
+			if (*Dirty == 0)
+			{
+				continue;
+			}
+			*Dirty = 0;
+			if (getBigAlloc(Seg))
+			{
+				ObjHeader *Header = findObjHeader(Card + OBJ_HEADER_SIZE);
+				if (Header != NULL)
+				{
+					scanCardRange(W, Header, Card);
+				}
+				continue;
+			}
+			char *Page = ADDR_TO_PAGE(Card);
+			PageInfo *Info = getPageInfo(Page);
+			if (Info->Class == NO_CLASS || isPointerFreePage(Info))
+			{
+				continue;
+			}
+			unsigned ClassSize = SizeClasses[Info->Class];
+			char *First = Page + getFirstSlot(Info->Class);
+			if (Card + CARD_SIZE <= First)
+			{
+				continue;
+			}
+			unsigned Slot = (Card > First) ? (Card - First) / ClassSize : 0;
+			unsigned LastSlot = (Card + CARD_SIZE - 1 - First) / ClassSize;
+			if (LastSlot >= getNumSlots(Info->Class))
+			{
+				LastSlot = getNumSlots(Info->Class) - 1;
+			}
+			for (; Slot <= LastSlot; Slot++)
+			{
+				scanCardRange(W, (ObjHeader*)getSlot(Page, Info->Class, Slot), Card);
+			}
+		}
+	}
+}
+
+/* scan the root chunks and the rescan task that are not
+ * yet claimed by other mark threads */
+static void scanRootChunks(MarkWorker *W)
+{
+	while (1)
+	{
+		unsigned Idx = __atomic_fetch_add(&NextRootChunk, 1, __ATOMIC_RELAXED);
+		if (Idx >= NumRootChunks)
+		{
+			break;
+		}
+		scanRootRange(W, RootChunks[Idx].Start, RootChunks[Idx].End);
+	}
+	if (__atomic_exchange_n(&RescanTask, 0, __ATOMIC_RELAXED))
+	{
+		rescanMarkedObjects(W);
+	}
+}
+
+static ObjHeader* stealWork(MarkWorker *W)
+{
+	unsigned Attempt;
+
+	if (NumMarkThreads == 1)
+	{
+		return NULL;
+	}
+	for (Attempt = 0; Attempt < STEAL_ATTEMPTS; Attempt++)
+	{
+		W->Seed = W->Seed * 1103515245 + 12345;
+		MarkWorker *Victim = &MarkWorkers[(W->Seed >> 16) % NumMarkThreads];
+		if (Victim == W)
+		{
+			continue;
+		}
+		ObjHeader *Header = stealObj(Victim);
+		if (Header != NULL)
+		{
+			return Header;
+		}
+	}
+	return NULL;
+}
+
+/* all mark threads are idle once none of them holds
+ * work. An idle thread that sees work left in some deque
+ * leaves the idle count again before stealing it.
+ */
+static int terminateMarking()
+{
+	unsigned Idx;
+
+	__atomic_fetch_add(&NumIdleWorkers, 1, __ATOMIC_SEQ_CST);
+	while (1)
+	{
+		if (__atomic_load_n(&NumIdleWorkers, __ATOMIC_SEQ_CST) == NumMarkThreads)
+		{
+			return 1;
+		}
+		for (Idx = 0; Idx < NumMarkThreads; Idx++)
+		{
+			if (!isDequeEmpty(&MarkWorkers[Idx]))
+			{
+				__atomic_fetch_sub(&NumIdleWorkers, 1, __ATOMIC_SEQ_CST);
+				return 0;
+			}
+		}
+		sched_yield();
+	}
+}
+
+/* scan objects in the deque of a mark thread.
+ * add newly encountered unmarked objects 
+ * to the deque after marking them, and steal from the
+ * other threads when it runs dry.
+ * Objects taken from the deque wait in a
+ * small FIFO, so that their headers are prefetched
+ * a few objects ahead of scanning.
+ */
+static void scanner(MarkWorker *W)
+{
+	ObjHeader *Fifo[PREFETCH_DEPTH];
+	unsigned Head = 0, Count = 0;
+
+	scanRootChunks(W);
+	while (1)
+	{
+		while (Count < PREFETCH_DEPTH)
+		{
+			ObjHeader *Header = takeObj(W);
+			if (Header == NULL)
+			{
+				break;
+			}
+			__builtin_prefetch(Header);
+			Fifo[(Head + Count) % PREFETCH_DEPTH] = Header;
+			Count++;
+		}
+		if (Count == 0)
+		{
+			ObjHeader *Header = stealWork(W);
+			if (Header != NULL)
+			{
+				scanObj(W, Header);
+				continue;
+			}
+			if (terminateMarking())
+			{
+				break;
+			}
+			continue;
+		}
+		ObjHeader *Header = Fifo[Head];
+		Head = (Head + 1) % PREFETCH_DEPTH;
+		Count--;
+		scanObj(W, Header);
+	}
+}
+
+static void* markThread(void *Arg)
+{
+	MarkWorker *W = (MarkWorker*)Arg;
+	unsigned Epoch = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&MarkLock);
+		while (MarkEpoch == Epoch)
+		{
+			pthread_cond_wait(&MarkStart, &MarkLock);
+		}
+		Epoch = MarkEpoch;
+		pthread_mutex_unlock(&MarkLock);
+
+		scanner(W);
+
+		pthread_mutex_lock(&MarkLock);
+		NumWorkersDone++;
+		pthread_cond_signal(&MarkDone);
+		pthread_mutex_unlock(&MarkLock);
+	}
+	return NULL;
+}
+
+/* The number of mark threads, including the collecting
+ * thread, comes from SAFEGC_MARK_THREADS (default 1).
+ */
+static void initMarkThreads()
+{
+	char *Env = getenv("SAFEGC_MARK_THREADS");
+	unsigned Idx;
+
+	NumMarkThreads = 1;
+	if (Env != NULL && atoi(Env) > 0)
+	{
+		NumMarkThreads = atoi(Env);
+	}
+	if (NumMarkThreads > MAX_MARK_THREADS)
+	{
+		NumMarkThreads = MAX_MARK_THREADS;
+	}
+	for (Idx = 0; Idx < NumMarkThreads; Idx++)
+	{
+		MarkWorker *W = &MarkWorkers[Idx];
+		W->Deque.Buf = malloc(MARK_DEQUE_SIZE * sizeof(ObjHeader*));
+		if (W->Deque.Buf == NULL)
+		{
+			printf("Unable to allocate mark deque\n");
+			exit(0);
+		}
+		W->Seed = Idx + 1;
+		if (Idx > 0 && createThread(&W->Thread, markThread, W) != 0)
+		{
+			printf("Unable to create mark thread\n");
+			exit(0);
+		}
+	}
+}
+
+/* mark everything reachable from the root chunks, using
+ * all mark threads */
+static void parallelMark()
+{
+	pthread_mutex_lock(&MarkLock);
+	NextRootChunk = 0;
+	NumIdleWorkers = 0;
+	NumWorkersDone = 0;
+	MarkEpoch++;
+	pthread_cond_broadcast(&MarkStart);
+	pthread_mutex_unlock(&MarkLock);
+
+	scanner(&MarkWorkers[0]);
+
+	pthread_mutex_lock(&MarkLock);
+	while (NumWorkersDone != NumMarkThreads - 1)
+	{
+		pthread_cond_wait(&MarkDone, &MarkLock);
+	}
+	pthread_mutex_unlock(&MarkLock);
+}
+
+/* the mark worker of the collecting thread, for the marking
+ * done outside markHeap */
+static MarkWorker* getCollectorWorker()
+{
+	if (NumMarkThreads == 0)
+	{
+		initMarkThreads();
+	}
+	return &MarkWorkers[0];
+}
+
+/* trace the heap from the collected root ranges */
+void markHeap()
+{
+	long long Start = getTimeNs();
+
+	getCollectorWorker();
+	parallelMark();
+	while (MarkOverflow)
+	{
+		MarkOverflow = 0;
+		NumRootChunks = 0;
+		RescanTask = 1;
+		parallelMark();
+	}
+	NumRootChunks = 0;
+	MarkTimeNs += getTimeNs() - Start;
+	endPhase(GC_PHASE_MARK, Start);
+}
+
+void resetMarkedBytes()
+{
+	unsigned Idx;
+
+	for (Idx = 0; Idx < MAX_MARK_THREADS; Idx++)
+	{
+		MarkWorkers[Idx].MarkedBytes = 0;
+		MarkWorkers[Idx].MarkedObjects = 0;
+	}
+}
+
+/* bytes marked by all mark threads since the reset */
+size_t getMarkedBytes()
+{
+	size_t Bytes = 0;
+	unsigned Idx;
+
+	for (Idx = 0; Idx < MAX_MARK_THREADS; Idx++)
+	{
+		Bytes += MarkWorkers[Idx].MarkedBytes;
+	}
+	return Bytes;
+}
+
+size_t getMarkedObjects()
+{
+	size_t Objects = 0;
+	unsigned Idx;
+
+	for (Idx = 0; Idx < MAX_MARK_THREADS; Idx++)
+	{
+		Objects += MarkWorkers[Idx].MarkedObjects;
+	}
+	return Objects;
+}
+
+/* mark the objects referenced from the collected root
+ * ranges, and queue them for the next markHeap */
+void markRootChunks()
+{
+	NextRootChunk = 0;
+	scanRootChunks(getCollectorWorker());
+	NumRootChunks = 0;
+}
+
+/* mark the object that Ptr points into, for markHeap to scan */
+void markPtr(void *Ptr)
+{
+	markObj(getCollectorWorker(), Ptr);
+}
+
+void markDirtyCards()
+{
+	scanDirtyCards(getCollectorWorker());
+}
+
+/* queue all 4-byte aligned addresses of a root range
+ * for marking. The range is split in chunks, so that
+ * the mark threads can share it.
+ */
+static void scanRoots(unsigned *Top, unsigned *Bottom)
+{
+	unsigned *Cur;
+	size_t ChunkLen = ROOT_CHUNK_SIZE / sizeof(unsigned);
+
+	Top = (unsigned*)Align((ulong64)Top, (ulong64)getRootAlign());
+	for (Cur = Top; Cur < Bottom; Cur += ChunkLen)
+	{
+		if (NumRootChunks == MaxRootChunks)
+		{
+			MaxRootChunks = (MaxRootChunks) ? MaxRootChunks * 2 : 64;
+			RootChunks = realloc(RootChunks, MaxRootChunks * sizeof(RootChunk));
+			if (RootChunks == NULL)
+			{
+				printf("Unable to allocate root chunks\n");
+				exit(0);
+			}
+		}
+		RootChunks[NumRootChunks].Start = Cur;
+		RootChunks[NumRootChunks].End = (Bottom - Cur > ChunkLen) ? Cur + ChunkLen : Bottom;
+		NumRootChunks++;
+	}
+}
+
+static size_t
+getDataSecSz()
+{
+	char Exec[PATH_SZ];
+	static size_t DsecSz = 0;
+
+	if (DsecSz != 0)
+	{
+		return DsecSz;
+	}
+	DsecSz = -1;
+
+	ssize_t Count = readlink( "/proc/self/exe", Exec, PATH_SZ);
+
+	if (Count == -1) {
+		return -1;
+	}
+	Exec[Count] = '\0';
+
+	int fd = open(Exec, O_RDONLY);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat Statbuf;
+	fstat(fd, &Statbuf);
+
+	char *Base = mmap(NULL, Statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (Base == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	Elf64_Ehdr *Header = (Elf64_Ehdr*)Base;
+
+	if (Header->e_ident[0] != 0x7f
+		|| Header->e_ident[1] != 'E'
+		|| Header->e_ident[2] != 'L'
+		|| Header->e_ident[3] != 'F')
+	{
+		goto out;
+	}
+
+	int i;
+	Elf64_Shdr *Shdr = (Elf64_Shdr*)(Base + Header->e_shoff);
+	char *Strtab = Base + Shdr[Header->e_shstrndx].sh_offset;
+
+	for (i = 0; i < Header->e_shnum; i++)
+	{
+		char *Name = Strtab + Shdr[i].sh_name;
+		if (!strncmp(Name, ".data", 6))
+		{
+			DsecSz = Shdr[i].sh_size;
+		}
+	}
+
+out:
+	munmap(Base, Statbuf.st_size);
+	close(fd);
+	return DsecSz;
+}
+
+
+
+/* mark the objects referenced from globals and the stack */
+void markRoots()
+{
+	size_t DataSecSz = getDataSecSz();
+	unsigned *DataStart;
+
+	if (DataSecSz == -1)
+	{
+		DataStart = (unsigned*)Align(((ulong64)&etext), 4);
+	}
+	else
+	{
+		DataStart = (unsigned*)Align(((ulong64)(&edata - DataSecSz)), 4);
+	}
+	unsigned *DataEnd = (unsigned*)((ulong64)(&edata) - 7);
+
+	/* scan global variables */
+	scanRoots(DataStart, DataEnd);
+
+	unsigned *UnDataStart = (unsigned*)Align(((ulong64)&edata), 4);
+	unsigned *UnDataEnd = (unsigned*)((ulong64)(&end) - 7);
+
+	/* scan uninitialized global variables */
+	scanRoots(UnDataStart, UnDataEnd);
+
+	/* scan the stacks of the parked threads */
+	ThreadCache *TC;
+	for (TC = ThreadCaches; TC != NULL; TC = TC->Next)
+	{
+		if (TC != MyCache && TC->StackBottom != NULL)
+		{
+			scanRoots(TC->StackTop, TC->StackBottom);
+		}
+		/* the argument of a thread that hasn't started yet */
+		scanRoots((unsigned*)&TC->StartArg, (unsigned*)(&TC->StartArg + 1));
+	}
+
+	if (MyCache == NULL)
+	{
+		/* the concurrent marker has no application stack */
+		return;
+	}
+	int Lvar;
+	unsigned *Bottom = getStackBottom();
+	if (Bottom == NULL)
+	{
+		return;
+	}
+	unsigned *Top = (unsigned*)&Lvar;
+	Top = (unsigned*)Align((ulong64)Top, 4);
+	/* skip GC stack frame */
+	while (Top[0] != MAGIC_ADDR)
+	{
+		assert(Top < Bottom);
+		Top++;
+	}
+	/* scan application stack */
+	scanRoots(Top, Bottom);
+}
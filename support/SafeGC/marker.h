@@ -0,0 +1,13 @@
+#ifndef __MARKER_H
+#define __MARKER_H
+
+/* The wrappers in mem.S push the callee-saved registers
+ * and then the marker below their frame pointer, so that
+ * the collector finds the registers of a thread and the
+ * frame of the wrapper from the marker. */
+#define MAGIC_ADDR 0x12abcdef
+#define NUM_SAVED_REGS 5
+/* from the marker up to the saved frame pointer */
+#define MARKER_TO_FRAME ((NUM_SAVED_REGS + 1) * 8)
+
+#endif
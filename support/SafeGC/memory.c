@@ -4,87 +4,68 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <string.h>
-#include <fcntl.h>
-#include <elf.h>
 #include <assert.h>
 #include <pthread.h>
+#include <dlfcn.h>
 #include "memory.h"
+#include "heap.h"
+
+#define DEFAULT_COMMIT_CHUNK HUGE_PAGE_SIZE
+#define LAZY_SWEEP_RATIO 4
+#define LAZY_SWEEP_LIMIT 64
+#define NUM_TYPE_INDEXES (1 << 16)
 
-typedef unsigned long long ulong64;
-#define MAGIC_ADDR 0x12abcdef
-#define PATH_SZ 128
-
-#define SEGMENT_SIZE (4ULL << 32)
-#define PAGE_SIZE 4096
-#define METADATA_SIZE ((SEGMENT_SIZE/PAGE_SIZE) * 2)
-#define NUM_PAGES_IN_SEG (METADATA_SIZE/2)
-#define OTHER_METADATA_SIZE ((METADATA_SIZE/PAGE_SIZE) * 2)
-#define COMMIT_SIZE PAGE_SIZE
-#define Align(x, y) (((x) + (y-1)) & ~(y-1))
-#define ADDR_TO_PAGE(x) (char*)(((ulong64)(x)) & ~(PAGE_SIZE-1))
-#define ADDR_TO_SEGMENT(x) (Segment*)(((ulong64)(x)) & ~(SEGMENT_SIZE-1))
-#define FREE 1
-#define MARK 2
-#define GC_THRESHOLD (32ULL << 20)
-
-long long NumGCTriggered = 0;
 long long NumBytesFreed = 0;
+/* bytes allocated by threads that have exited, the
+ * live threads keep their own count */
 long long NumBytesAllocated = 0;
-extern char  etext, edata, end;
+long long NumBigRunsReused = 0;
 
-struct OtherMetadata
+SegmentList *Segments = NULL;
+/* Address range covered by the segments, and the segments
+ * indexed by address >> SEGMENT_SHIFT. The table is not in
+ * .bss, so that it is not scanned as a root.
+ */
+char *HeapStart = (char*)~0ULL;
+char *HeapEnd = NULL;
+Segment **SegmentTable = NULL;
+
+/* slot sizes, including the object header. The classes
+ * of the pointer-free pages follow the regular ones, and
+ * the headerless classes come last. */
+const unsigned SizeClasses[NUM_CLASSES] =
 {
-	char *AllocPtr;
-	char *CommitPtr;
-	char *ReservePtr;
-	char *DataPtr;
-	int BigAlloc;
+	24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224,
+	256, 320, 384, 448, 512, 640, 768, 1024, 1360, 2048, 4096,
+	24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224,
+	256, 320, 384, 448, 512, 640, 768, 1024, 1360, 2048, 4096,
+	8, 16, 24, 32
 };
 
-typedef struct Segment
-{
-	union
-	{
-		unsigned short Size[NUM_PAGES_IN_SEG];
-		struct OtherMetadata Other;
-	};
-} Segment;
-
-typedef struct SegmentList
-{
-	struct Segment *Segment;
-	struct SegmentList *Next;
-} SegmentList;
-
-typedef struct ObjHeader
-{
-	unsigned Size;
-	unsigned short Status;
-	unsigned short Alignment;
-	ulong64 Type;
-} ObjHeader;
-
-#define OBJ_HEADER_SIZE (sizeof(ObjHeader))
-
-
-static SegmentList *Segments = NULL;
+/* A headerless page starts with a free bit and a type index
+ * per slot, the slots follow at the first 8-byte boundary.
+ * The layouts fill the page as far as the slot size allows.
+ */
+const unsigned HeaderlessSlots[NUM_HEADERLESS_CLASSES] = { 404, 225, 156, 120 };
+const unsigned HeaderlessFirstSlot[NUM_HEADERLESS_CLASSES] = { 864, 488, 336, 256 };
+/* interned type bitmaps of the headerless objects, indexed
+ * by their type index. Allocated with the first headerless
+ * page, outside the roots. */
+ulong64 *TypeTable = NULL;
+static pthread_mutex_t TypeLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char SizeToClass[MAX_SMALL_SIZE/8 + 1];
+
+/* protects everything but the thread caches of other threads.
+ * The thread caches double as the registry of mutator threads.
+ */
+static pthread_mutex_t HeapLock = PTHREAD_MUTEX_INITIALIZER;
+ThreadCache *ThreadCaches = NULL;
+__thread ThreadCache *MyCache = NULL;
+static pthread_key_t CacheKey;
+static pthread_once_t CacheKeyOnce = PTHREAD_ONCE_INIT;
 
-static void setAllocPtr(Segment *Seg, char *Ptr) { Seg->Other.AllocPtr = Ptr; }
-static void setCommitPtr(Segment *Seg, char *Ptr) { Seg->Other.CommitPtr = Ptr; }
-static void setReservePtr(Segment *Seg, char *Ptr) { Seg->Other.ReservePtr = Ptr; }
-static void setDataPtr(Segment *Seg, char *Ptr) { Seg->Other.DataPtr = Ptr; }
-static char* getAllocPtr(Segment *Seg) { return Seg->Other.AllocPtr; }
-static char* getCommitPtr(Segment *Seg) { return Seg->Other.CommitPtr; }
-static char* getReservePtr(Segment *Seg) { return Seg->Other.ReservePtr; }
-static char* getDataPtr(Segment *Seg) { return Seg->Other.DataPtr; }
-static void setBigAlloc(Segment *Seg, int BigAlloc) { Seg->Other.BigAlloc = BigAlloc; }
-static int getBigAlloc(Segment *Seg) { return Seg->Other.BigAlloc; }
-//static void myfree(void *Ptr);
-static void checkAndRunGC();
+static Segment *SmallSeg = NULL;
+char *PartialPages[NUM_CLASSES];
 
 static void addToSegmentList(Segment *Seg)
 {
@@ -97,6 +78,26 @@ static void addToSegmentList(Segment *Seg)
 	L->Segment = Seg;
 	L->Next = Segments;
 	Segments = L;
+
+	if (SegmentTable == NULL)
+	{
+		SegmentTable = calloc(NUM_SEGMENT_SLOTS, sizeof(Segment*));
+		if (SegmentTable == NULL)
+		{
+			printf("Unable to allocate segment table\n");
+			exit(0);
+		}
+	}
+	assert(((ulong64)Seg >> SEGMENT_SHIFT) < NUM_SEGMENT_SLOTS);
+	__atomic_store_n(&SegmentTable[(ulong64)Seg >> SEGMENT_SHIFT], Seg, __ATOMIC_RELEASE);
+	if ((char*)Seg < HeapStart)
+	{
+		__atomic_store_n(&HeapStart, (char*)Seg, __ATOMIC_RELEASE);
+	}
+	if ((char*)Seg + SEGMENT_SIZE > HeapEnd)
+	{
+		__atomic_store_n(&HeapEnd, (char*)Seg + SEGMENT_SIZE, __ATOMIC_RELEASE);
+	}
 }
 
 static void allowAccess(void *Ptr, size_t Size)
@@ -112,6 +113,72 @@ static void allowAccess(void *Ptr, size_t Size)
 	}
 }
 
+static void allowRange(void *Start, void *End)
+{
+	char *First = ADDR_TO_PAGE(Start);
+	allowAccess(First, Align((ulong64)End, PAGE_SIZE) - (ulong64)First);
+}
+
+/* The side tables of a segment are reserved for the whole
+ * segment but made accessible only for the data that is
+ * committed, so that the metadata grows with the data area.
+ * Big segments have no page infos and one mark bit per page.
+ */
+static void commitMetadata(Segment *Seg, char *Start, char *End)
+{
+	ulong64 Bit;
+	ulong64 FirstCard = (Start - (char*)Seg) / CARD_SIZE;
+	ulong64 LastCard = (End - 1 - (char*)Seg) / CARD_SIZE;
+
+	allowRange(getSizeMetadata(Start), getSizeMetadata(End - 1) + 1);
+	allowRange(getMarkWord(Start, &Bit), getMarkWord(End - 1, &Bit) + 1);
+	allowRange(&Seg->Cards[FirstCard], &Seg->Cards[LastCard] + 1);
+	if (!getBigAlloc(Seg))
+	{
+		allowRange(getPageInfo(Start), getPageInfo(End - 1) + 1);
+	}
+}
+
+/* The segments are committed in chunks of SAFEGC_COMMIT_CHUNK_KB
+ * (2 MiB by default, rounded up to a power of two pages), so that
+ * allocation rarely needs a system call.
+ */
+static size_t getCommitChunk()
+{
+	static size_t CommitChunk = 0;
+
+	if (CommitChunk == 0)
+	{
+		char *Env = getenv("SAFEGC_COMMIT_CHUNK_KB");
+		size_t Requested = DEFAULT_COMMIT_CHUNK;
+		if (Env != NULL && atoi(Env) > 0)
+		{
+			Requested = (size_t)atoi(Env) << 10;
+		}
+		CommitChunk = PAGE_SIZE;
+		while (CommitChunk < Requested && CommitChunk < SEGMENT_SIZE / 2)
+		{
+			CommitChunk <<= 1;
+		}
+	}
+	return CommitChunk;
+}
+
+/* Transparent huge pages cut the TLB misses of the marker.
+ * They are on unless SAFEGC_HUGEPAGES=0.
+ */
+static int useHugePages()
+{
+	static int HugePages = -1;
+
+	if (HugePages == -1)
+	{
+		char *Env = getenv("SAFEGC_HUGEPAGES");
+		HugePages = (Env == NULL || atoi(Env) != 0);
+	}
+	return HugePages;
+}
+
 static Segment* allocateSegment(int BigAlloc)
 {
 	void* Base = mmap(NULL, SEGMENT_SIZE * 2, PROT_NONE, MAP_ANON|MAP_PRIVATE, -1, 0);
@@ -123,91 +190,188 @@ static Segment* allocateSegment(int BigAlloc)
 
 	/* segments are aligned to segment size */
 	Segment *Segment = (struct Segment*)Align((ulong64)Base, SEGMENT_SIZE);
-	allowAccess(Segment, METADATA_SIZE);
+	/* the rest of the metadata is committed with the data */
+	allowAccess(Segment, Align(sizeof(struct OtherMetadata), PAGE_SIZE));
 
 	char *AllocPtr = (char*)Segment + METADATA_SIZE;
 	char *ReservePtr = (char*)Segment + SEGMENT_SIZE;
+	if (useHugePages())
+	{
+		/* without kernel support the data area keeps small pages */
+		madvise(AllocPtr, ReservePtr - AllocPtr, MADV_HUGEPAGE);
+	}
 	setAllocPtr(Segment, AllocPtr);
 	setReservePtr(Segment, ReservePtr);
 	setCommitPtr(Segment, AllocPtr);
 	setDataPtr(Segment, AllocPtr);
+	setSweepPtr(Segment, AllocPtr);
+	setSweepLimit(Segment, AllocPtr);
 	setBigAlloc(Segment, BigAlloc);
 	addToSegmentList(Segment);
 	return Segment;
 }
 
-static void extendCommitSpace(Segment *Seg)
+/* commit the segment up to at least Limit, in whole
+ * commit chunks and with a single mprotect */
+static void extendCommitSpace(Segment *Seg, char *Limit)
 {
-	char *AllocPtr = getAllocPtr(Seg);
 	char *CommitPtr = getCommitPtr(Seg);
 	char *ReservePtr = getReservePtr(Seg);
-	char *NewCommitPtr = CommitPtr + COMMIT_SIZE;
 
-	assert(AllocPtr == CommitPtr);
-	if (NewCommitPtr <= ReservePtr)
+	if (Limit <= CommitPtr)
+	{
+		return;
+	}
+	char *NewCommitPtr = CommitPtr + Align((ulong64)(Limit - CommitPtr), getCommitChunk());
+	if (NewCommitPtr > ReservePtr)
 	{
-		allowAccess(CommitPtr, COMMIT_SIZE);
+		NewCommitPtr = ReservePtr;
+	}
+	if (NewCommitPtr > CommitPtr)
+	{
+		commitMetadata(Seg, CommitPtr, NewCommitPtr);
+		allowAccess(CommitPtr, NewCommitPtr - CommitPtr);
 		setCommitPtr(Seg, NewCommitPtr);
 	}
-	else
+}
+
+/* Find the index of a type bitmap, adding it to the table the
+ * first time. The table is open addressed and its entries are
+ * never removed, so lookups don't take the lock.
+ */
+static unsigned short internType(ulong64 Type)
+{
+	ulong64 Hash = (Type * 0x9E3779B97F4A7C15ULL) >> 32;
+	unsigned Probe;
+
+	if (Type == 0)
+	{
+		return POINTER_FREE_INDEX;
+	}
+	for (Probe = 0; Probe < NUM_TYPE_INDEXES; Probe++)
 	{
-		assert(CommitPtr == ReservePtr);
+		unsigned Idx = POINTER_FREE_INDEX + 1
+			+ (Hash + Probe) % (NUM_TYPE_INDEXES - POINTER_FREE_INDEX - 1);
+		ulong64 Cur = __atomic_load_n(&TypeTable[Idx], __ATOMIC_ACQUIRE);
+		if (Cur == 0)
+		{
+			pthread_mutex_lock(&TypeLock);
+			Cur = TypeTable[Idx];
+			if (Cur == 0)
+			{
+				__atomic_store_n(&TypeTable[Idx], Type, __ATOMIC_RELEASE);
+				Cur = Type;
+			}
+			pthread_mutex_unlock(&TypeLock);
+		}
+		if (Cur == Type)
+		{
+			return Idx;
+		}
 	}
+	printf("Too many object types\n");
+	exit(0);
 }
 
-static unsigned short* getSizeMetadata(char *Ptr)
+/* SAFEGC_HEADERLESS=0 gives the small objects headers again */
+static int useHeaderless()
 {
-	char *Page = ADDR_TO_PAGE(Ptr);
-	Segment *Seg = ADDR_TO_SEGMENT(Ptr);
-	ulong64 PageNo = (Page - (char*)Seg)/ PAGE_SIZE;
-	return &Seg->Size[PageNo];
+	static int HeaderlessOn = -1;
+
+	if (HeaderlessOn == -1)
+	{
+		char *Env = getenv("SAFEGC_HEADERLESS");
+		HeaderlessOn = (Env == NULL || atoi(Env) != 0);
+	}
+	return HeaderlessOn;
 }
 
-static void createHole(Segment *Seg)
+static unsigned getSizeClass(size_t AlignedSize)
 {
-	char *AllocPtr = getAllocPtr(Seg);
-	char *CommitPtr = getCommitPtr(Seg);
-	size_t HoleSz = CommitPtr - AllocPtr;
-	if (HoleSz > 0)
+	static int Initialized = 0;
+
+	if (!Initialized)
 	{
-		assert(HoleSz >= 8);
-		ObjHeader *Header = (ObjHeader*)AllocPtr;
-		Header->Size = HoleSz;
-		Header->Status = 0;
-		Header->Alignment = 0;
-		setAllocPtr(Seg, CommitPtr);
-		myfree(AllocPtr + OBJ_HEADER_SIZE);
-		NumBytesFreed -= HoleSz;
+		unsigned Class = 0;
+		size_t Sz;
+		for (Sz = 0; Sz <= MAX_SMALL_SIZE; Sz += 8)
+		{
+			while (SizeClasses[Class] < Sz)
+			{
+				Class++;
+			}
+			SizeToClass[Sz/8] = Class;
+		}
+		Initialized = 1;
 	}
+	assert(AlignedSize <= MAX_SMALL_SIZE && (AlignedSize % 8) == 0);
+	return SizeToClass[AlignedSize/8];
 }
 
-static void reclaimMemory(void *Ptr, size_t Size)
+/* add a page with free slots to the partial list of its class */
+void listPage(char *Page)
 {
-	assert((Size % PAGE_SIZE) == 0);
-	assert(((ulong64)Ptr & (PAGE_SIZE-1)) == 0);
-	
-	int Ret = mprotect(Ptr, Size, PROT_NONE);
-	if (Ret == -1)
+	PageInfo *Info = getPageInfo(Page);
+	assert((Info->Flags & PAGE_LISTED) == 0);
+	Info->Flags |= PAGE_LISTED;
+	Info->Next = PartialPages[Info->Class];
+	PartialPages[Info->Class] = Page;
+}
+
+/* Wait for the heap lock. A collection holds the lock
+ * while the world is stopped, so a registered thread that
+ * blocks here counts as parked. Spilling the callee-saved
+ * registers into this frame keeps their pointers visible
+ * to the collector.
+ */
+static void __attribute__((noinline)) parkAndLock(ThreadCache *TC)
+{
+	int Lvar;
+
+	__builtin_unwind_init();
+	TC->StackTop = (unsigned*)Align((ulong64)&Lvar, 4);
+	__atomic_store_n(&TC->Parked, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&HeapLock);
+	__atomic_store_n(&TC->Parked, 0, __ATOMIC_SEQ_CST);
+}
+
+void lockHeap()
+{
+	if (pthread_mutex_trylock(&HeapLock) == 0)
 	{
-		printf("unable to mprotect %s():%d\n", __func__, __LINE__);
-		exit(0);
+		return;
 	}
-	Ret = madvise(Ptr, Size, MADV_DONTNEED);
-	if (Ret == -1)
+	if (MyCache == NULL)
 	{
-		printf("unable to reclaim physical page %s():%d\n", __func__, __LINE__);
-		exit(0);
+		/* unregistered threads are not waited for */
+		pthread_mutex_lock(&HeapLock);
+		return;
 	}
+	parkAndLock(MyCache);
 }
 
-/* used by the GC to free objects. */
-void myfree(void *Ptr)
+void unlockHeap()
 {
-	ObjHeader *Header = (ObjHeader*)((char*)Ptr - OBJ_HEADER_SIZE);
-	assert((Header->Status & FREE) == 0);
-	NumBytesFreed += Header->Size;
+	pthread_mutex_unlock(&HeapLock);
+}
 
-	if (Header->Size > COMMIT_SIZE)
+void freeObj(void *Ptr)
+{
+	ObjHeader *Header = ObjToHeader(Ptr);
+	/* a background sweeper owns the page and may be reading
+	 * its mark bits and free states; let it finish, so that
+	 * the slot is freed and counted once, here */
+	if (getObjSize(Header) <= MAX_SMALL_SIZE
+		&& (getPageInfo(ADDR_TO_PAGE(Header))->Flags & PAGE_SWEEPING))
+	{
+		finishBackgroundSweeps();
+	}
+	assert(!isObjFree(Header));
+	NumBytesFreed += getObjSize(Header);
+	/* the slot may be swept before the next mark */
+	clearMark(Header);
+
+	if (getObjSize(Header) > MAX_SMALL_SIZE)
 	{
 		assert((Header->Size % PAGE_SIZE) == 0);
 		assert(((ulong64)Header & (PAGE_SIZE-1)) == 0);
@@ -220,32 +384,99 @@ void myfree(void *Ptr)
 			SzMeta[0] = PAGE_SIZE;
 		}
 		Header->Status = FREE;
-		reclaimMemory(Header, Header->Size);
+		if (MarkingActive)
+		{
+			/* the marker may still read the object */
+			*(char**)Ptr = DeferredBigFrees;
+			DeferredBigFrees = (char*)Header;
+			return;
+		}
+		queueDecommit((char*)Header, Header->Size, 0);
 		return;
 	}
 
-	unsigned short *SzMeta = getSizeMetadata((char*)Header);
-	SzMeta[0] += Header->Size;
-	assert(SzMeta[0] <= PAGE_SIZE);
-	Header->Status = FREE;
-	if (SzMeta[0] == PAGE_SIZE)
+	char *Page = ADDR_TO_PAGE(Header);
+	PageInfo *Info = getPageInfo(Page);
+	assert(Info->Class != NO_CLASS);
+	assert((Info->Flags & PAGE_SWEEPING) == 0);
+	setObjFree(Header, 1);
+	*(char**)Ptr = Info->FreeList;
+	Info->FreeList = (char*)Header;
+	Info->NumFree++;
+
+	/* an unswept page gets its free list rebuilt by the sweep */
+	if ((Info->Flags & PAGE_LISTED) || isUnswept(Page))
+	{
+		return;
+	}
+	/* the concurrent marker may still read the page */
+	if (Info->NumFree == getNumSlots(Info->Class) && !MarkingActive)
+	{
+		releasePage(Page);
+	}
+	else
 	{
-		char *Page = ADDR_TO_PAGE(Ptr);
-		reclaimMemory(Page, PAGE_SIZE);
+		listPage(Page);
 	}
 }
 
+/* used by the GC to free objects. */
+void myfree(void *Ptr)
+{
+	lockHeap();
+	freeObj(Ptr);
+	unlockHeap();
+}
+
+/* reuse a free run for a big object. A run in the unswept
+ * range gets its object marked, so that the pending sweep
+ * doesn't free it. */
+static void* reuseFreeRun(size_t AlignedSize)
+{
+	char *Start = takeFreeRun(AlignedSize);
+	size_t Iter;
+
+	if (Start == NULL)
+	{
+		return NULL;
+	}
+	allowAccess(Start, AlignedSize);
+	for (Iter = PAGE_SIZE; Iter < AlignedSize; Iter += PAGE_SIZE)
+	{
+		unsigned short *SzMeta = getSizeMetadata(Start + Iter);
+		SzMeta[0] = 0;
+	}
+	unsigned short *SzMeta = getSizeMetadata(Start);
+	SzMeta[0] = 1;
+
+	ObjHeader *Header = (ObjHeader*)Start;
+	Header->Size = AlignedSize;
+	Header->Status = 0;
+	Header->Alignment = 0;
+	Header->Type = 0;
+	if (isUnswept(Start))
+	{
+		setMark(Header);
+	}
+	NumBigRunsReused++;
+	return Start + OBJ_HEADER_SIZE;
+}
+
 static void* BigAlloc(size_t Size)
 {
 	size_t AlignedSize = Align(Size + OBJ_HEADER_SIZE, PAGE_SIZE);
 	assert(AlignedSize <= SEGMENT_SIZE - METADATA_SIZE);
 	static Segment *CurSeg = NULL;
+	void *Obj = reuseFreeRun(AlignedSize);
+	if (Obj != NULL)
+	{
+		return Obj;
+	}
 	if (CurSeg == NULL)
 	{
 		CurSeg = allocateSegment(1);
 	}
 	char *AllocPtr = getAllocPtr(CurSeg);
-	char *CommitPtr = getCommitPtr(CurSeg);
 	char *NewAllocPtr = AllocPtr + AlignedSize;
 	char *ReservePtr = getReservePtr(CurSeg);
 	if (NewAllocPtr > ReservePtr)
@@ -253,10 +484,8 @@ static void* BigAlloc(size_t Size)
 		CurSeg = allocateSegment(1);
 		return BigAlloc(Size);
 	}
-	assert(AllocPtr == CommitPtr);
-	allowAccess(CommitPtr, AlignedSize);
+	extendCommitSpace(CurSeg, NewAllocPtr);
 	setAllocPtr(CurSeg, NewAllocPtr);
-	setCommitPtr(CurSeg, NewAllocPtr);
 
 	unsigned short *SzMeta = getSizeMetadata(AllocPtr);
 	SzMeta[0] = 1;
@@ -270,246 +499,597 @@ static void* BigAlloc(size_t Size)
 }
 
 
-void *_mymalloc(size_t Size)
+/* take a page from the retained or the decommitted pool,
+ * or from the top of the small segment */
+static char* allocatePage()
 {
-	size_t AlignedSize = Align(Size, 8) + OBJ_HEADER_SIZE;
+	char *Page;
 
-	NumBytesAllocated += AlignedSize;
-	checkAndRunGC(AlignedSize);
-	if (AlignedSize > COMMIT_SIZE)
+	if (RetainedPages != NULL)
 	{
-		return BigAlloc(Size);
+		Page = RetainedPages;
+		PageInfo *Info = getPageInfo(Page);
+		RetainedPages = Info->Next;
+		NumRetainedPages--;
+		if (isUnswept(Page))
+		{
+			Info->Flags |= PAGE_SKIP_SWEEP;
+		}
+		return Page;
+	}
+	if (FreePages != NULL)
+	{
+		Page = FreePages;
+		PageInfo *Info = getPageInfo(Page);
+		FreePages = Info->Next;
+		allowAccess(Page, PAGE_SIZE);
+		if (isUnswept(Page))
+		{
+			/* the new objects carry no marks */
+			Info->Flags |= PAGE_SKIP_SWEEP;
+		}
+		return Page;
 	}
-	assert(Size != 0);
-	assert(sizeof(struct OtherMetadata) <= OTHER_METADATA_SIZE);
-	assert(sizeof(struct Segment) == METADATA_SIZE);
-
-	static Segment *CurSeg = NULL;
 
-	if (CurSeg == NULL)
+	if (SmallSeg == NULL)
 	{
-		CurSeg = allocateSegment(0);
+		SmallSeg = allocateSegment(0);
 	}
-	char *AllocPtr = getAllocPtr(CurSeg);
-	char *CommitPtr = getCommitPtr(CurSeg);
-	char *NewAllocPtr = AllocPtr + AlignedSize;
-	if (NewAllocPtr > CommitPtr)
+	if (getAllocPtr(SmallSeg) == getCommitPtr(SmallSeg))
 	{
-		if (AllocPtr != CommitPtr)
+		extendCommitSpace(SmallSeg, getAllocPtr(SmallSeg) + PAGE_SIZE);
+		if (getAllocPtr(SmallSeg) == getCommitPtr(SmallSeg))
 		{
-			/* Free remaining space on this page */
-			createHole(CurSeg);
+			SmallSeg = allocateSegment(0);
+			extendCommitSpace(SmallSeg, getAllocPtr(SmallSeg) + PAGE_SIZE);
 		}
-		extendCommitSpace(CurSeg);
-		AllocPtr = getAllocPtr(CurSeg);
-		NewAllocPtr = AllocPtr + AlignedSize;
-		CommitPtr = getCommitPtr(CurSeg);
-		if (NewAllocPtr > CommitPtr)
+	}
+	Page = getAllocPtr(SmallSeg);
+	setAllocPtr(SmallSeg, Page + PAGE_SIZE);
+	return Page;
+}
+
+/* carve a fresh page into free slots of a size class */
+char* createPage(unsigned Class)
+{
+	char *Page = allocatePage();
+	PageInfo *Info = getPageInfo(Page);
+	unsigned ClassSize = SizeClasses[Class];
+	int Slot;
+
+	Info->FreeList = NULL;
+	if (isHeaderlessClass(Class))
+	{
+		unsigned NumSlots = getNumSlots(Class);
+		assert(getFirstSlot(Class) >= Align(NumSlots, 64) / 8 + NumSlots * sizeof(short));
+		assert(getFirstSlot(Class) + NumSlots * ClassSize <= PAGE_SIZE);
+		if (TypeTable == NULL)
 		{
-			CurSeg = allocateSegment(0);
-			return _mymalloc(Size);
+			TypeTable = calloc(NUM_TYPE_INDEXES, sizeof(ulong64));
+			if (TypeTable == NULL)
+			{
+				printf("Unable to allocate type table\n");
+				exit(0);
+			}
 		}
+		memset(getFreeBits(Page), 0xff, Align(NumSlots, 64) / 8);
+		memset(getTypeIndexes(Page, Class), 0, NumSlots * sizeof(short));
 	}
-
-	setAllocPtr(CurSeg, NewAllocPtr);
-	ObjHeader *Header = (ObjHeader*)AllocPtr;
-	Header->Size = AlignedSize;
-	Header->Status = 0;
-	Header->Alignment = 0;
-	Header->Type = 0;
-	return AllocPtr + OBJ_HEADER_SIZE;
+	for (Slot = getNumSlots(Class) - 1; Slot >= 0; Slot--)
+	{
+		ObjHeader *Header = (ObjHeader*)getSlot(Page, Class, Slot);
+		if (!isHeaderlessClass(Class))
+		{
+			Header->Size = ClassSize;
+			Header->Status = FREE;
+		}
+		*(char**)((char*)Header + getSlotHeaderSize(Class)) = Info->FreeList;
+		Info->FreeList = (char*)Header;
+	}
+	Info->NumFree = getNumSlots(Class);
+	Info->Class = Class;
+	Info->Flags |= PAGE_LISTED;
+	return Page;
 }
 
-/* scan objects in the scanner list.
- * add newly encountered unmarked objects 
- * to the scanner list after marking them.
- */
-void scanner()
+/* hand the owned page of a class back to the heap,
+ * along with the free slots left in the private list */
+void returnPage(ThreadCache *TC, unsigned Class)
 {
+	char *Page = TC->Pages[Class];
+	if (Page == NULL)
+	{
+		return;
+	}
+	PageInfo *Info = getPageInfo(Page);
+	char *Cur = TC->FreeLists[Class];
+	while (Cur != NULL)
+	{
+		char **Link = (char**)(Cur + getSlotHeaderSize(Class));
+		char *Next = *Link;
+		*Link = Info->FreeList;
+		Info->FreeList = Cur;
+		Info->NumFree++;
+		Cur = Next;
+	}
+	TC->FreeLists[Class] = NULL;
+	TC->Pages[Class] = NULL;
+	Info->Flags &= ~PAGE_LISTED;
+
+	/* an unswept page gets its free list rebuilt by the sweep */
+	if (Info->NumFree == 0 || isUnswept(Page))
+	{
+		return;
+	}
+	if (Info->NumFree == getNumSlots(Class) && !MarkingActive)
+	{
+		releasePage(Page);
+	}
+	else
+	{
+		listPage(Page);
+	}
 }
 
-/* Free all unmarked objects. */
-void sweep()
+/* move the free list of an owned page to the private list */
+static void takeFreeList(ThreadCache *TC, unsigned Class, char *Page)
 {
+	PageInfo *Info = getPageInfo(Page);
+	TC->Pages[Class] = Page;
+	TC->FreeLists[Class] = Info->FreeList;
+	Info->FreeList = NULL;
+	Info->NumFree = 0;
+	Info->Flags |= PAGE_NURSERY;
 }
 
-/* walk all 4-byte aligned addresses.
- * add unmarked valid objects to the 
- * scanner list after marking them
- * for scanning.
+/* find the next page to allocate objects of a class
+ * from: the slots freed into the owned page, a partially
+ * free page, one that the lazy sweep frees up, or a
+ * fresh page. Called with the heap lock held.
  */
-static void scanRoots(unsigned *Top, unsigned *Bottom)
+static void refillCache(ThreadCache *TC, unsigned Class)
 {
+	size_t Budget = LAZY_SWEEP_LIMIT;
+	char *Page = TC->Pages[Class];
+
+	if (Page != NULL && getPageInfo(Page)->FreeList != NULL)
+	{
+		takeFreeList(TC, Class, Page);
+		return;
+	}
+	returnPage(TC, Class);
+	publishSweptPages();
+	while (PartialPages[Class] == NULL && Budget > 0)
+	{
+		lazySweep(1);
+		Budget--;
+	}
+	if (PartialPages[Class] != NULL)
+	{
+		Page = PartialPages[Class];
+		PageInfo *Info = getPageInfo(Page);
+		PartialPages[Class] = Info->Next;
+		assert(Info->NumFree > 0);
+	}
+	else
+	{
+		Page = createPage(Class);
+	}
+	takeFreeList(TC, Class, Page);
 }
 
-static size_t
-getDataSecSz()
+/* a thread that exits returns its pages and folds
+ * its counters into the global ones */
+static void destroyThreadCache(void *Arg)
 {
-	char Exec[PATH_SZ];
-	static size_t DsecSz = 0;
+	ThreadCache *TC = (ThreadCache*)Arg;
+	ThreadCache **Prev;
+	unsigned Class;
 
-	if (DsecSz != 0)
+	lockHeap();
+	for (Class = 0; Class < NUM_CLASSES; Class++)
 	{
-		return DsecSz;
+		returnPage(TC, Class);
 	}
-	DsecSz = -1;
-
-	ssize_t Count = readlink( "/proc/self/exe", Exec, PATH_SZ);
+	NumBytesAllocated += TC->NumBytesAllocated;
+	flushSatbBuffer(TC);
+	for (Prev = &ThreadCaches; *Prev != TC; Prev = &(*Prev)->Next)
+	{
+		assert(*Prev != NULL);
+	}
+	*Prev = TC->Next;
+	unlockHeap();
+	free(TC);
+	MyCache = NULL;
+}
 
-	if (Count == -1) {
-		return -1;
+static void createCacheKey()
+{
+	if (pthread_key_create(&CacheKey, destroyThreadCache) != 0)
+	{
+		printf("Unable to create thread cache key\n");
+		exit(0);
 	}
-	Exec[Count] = '\0';
+	/* there are no minor collections between concurrent cycles */
+	if (isConcurrentMode() && isGenerationalMode())
+	{
+		printf("SAFEGC_CONCURRENT and SAFEGC_GENERATIONAL can't be used together\n");
+		exit(0);
+	}
+	/* both modes rely on the barriers to see the pointers
+	 * stored while marking, or into old objects */
+	if ((isConcurrentMode() || isGenerationalMode()) && &SafeGCWriteBarriers == NULL)
+	{
+		printf("SAFEGC_CONCURRENT and SAFEGC_GENERATIONAL need a program compiled with write barriers\n");
+		exit(0);
+	}
+}
 
-	int fd = open(Exec, O_RDONLY);
-	if (fd == -1) {
-		return -1;
+unsigned* getStackBottom()
+{
+	void *Base;
+	size_t Size;
+	pthread_attr_t Attr;
+	
+	int Ret = pthread_getattr_np(pthread_self(), &Attr);
+	if (Ret != 0)
+	{
+		printf("Error getting stackinfo\n");
+		return NULL;
+	}
+	Ret = pthread_attr_getstack(&Attr , &Base, &Size);
+	pthread_attr_destroy(&Attr);
+	if (Ret != 0)
+	{
+		printf("Error getting stackinfo\n");
+		return NULL;
 	}
+	return (unsigned*)(Base + Size - 7);
+}
 
-	struct stat Statbuf;
-	fstat(fd, &Statbuf);
+static ThreadCache* allocThreadCache()
+{
+	pthread_once(&CacheKeyOnce, createCacheKey);
+	initTelemetry();
+	ThreadCache *TC = calloc(1, sizeof(ThreadCache));
+	if (TC == NULL)
+	{
+		printf("Unable to allocate thread cache\n");
+		exit(0);
+	}
+	initSampling(TC);
+	return TC;
+}
 
-	char *Base = mmap(NULL, Statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (Base == NULL) {
-		close(fd);
-		return -1;
+/* register the calling thread on its first allocation or
+ * safepoint poll, the threads it creates are registered
+ * by pthread_create below */
+ThreadCache* getThreadCache()
+{
+	if (MyCache != NULL)
+	{
+		return MyCache;
 	}
+	ThreadCache *TC = allocThreadCache();
+	TC->StackBottom = getStackBottom();
+	pthread_mutex_lock(&HeapLock);
+	TC->Next = ThreadCaches;
+	ThreadCaches = TC;
+	pthread_mutex_unlock(&HeapLock);
+	pthread_setspecific(CacheKey, TC);
+	MyCache = TC;
+	return TC;
+}
+
+typedef int (*PthreadCreateFn)(pthread_t*, const pthread_attr_t*,
+	void *(*)(void*), void*);
 
-	Elf64_Ehdr *Header = (Elf64_Ehdr*)Base;
+static PthreadCreateFn getRealPthreadCreate()
+{
+	static PthreadCreateFn RealCreate = NULL;
 
-	if (Header->e_ident[0] != 0x7f
-		|| Header->e_ident[1] != 'E'
-		|| Header->e_ident[2] != 'L'
-		|| Header->e_ident[3] != 'F')
+	if (RealCreate == NULL)
 	{
-		goto out;
+		RealCreate = (PthreadCreateFn)dlsym(RTLD_NEXT, "pthread_create");
+		if (RealCreate == NULL)
+		{
+			printf("Unable to find pthread_create\n");
+			exit(0);
+		}
 	}
+	return RealCreate;
+}
+
+/* the collector's own threads are never registered */
+int createThread(pthread_t *Thread, void *(*Fn)(void*), void *Arg)
+{
+	return getRealPthreadCreate()(Thread, NULL, Fn, Arg);
+}
 
-	int i;
-	Elf64_Shdr *Shdr = (Elf64_Shdr*)(Base + Header->e_shoff);
-	char *Strtab = Base + Shdr[Header->e_shstrndx].sh_offset;
+typedef struct ThreadStart
+{
+	void *(*Fn)(void*);
+	ThreadCache *TC;
+} ThreadStart;
 
-	for (i = 0; i < Header->e_shnum; i++)
+/* Runs first in a thread created by the application. The
+ * thread was registered parked by its creator, so it
+ * unparks only once no collection is running.
+ */
+static void* startThread(void *Arg)
+{
+	ThreadStart *Start = (ThreadStart*)Arg;
+	ThreadCache *TC = Start->TC;
+	void *(*Fn)(void*) = Start->Fn;
+	unsigned *Bottom = getStackBottom();
+
+	free(Start);
+	pthread_setspecific(CacheKey, TC);
+	MyCache = TC;
+	pthread_mutex_lock(&HeapLock);
+	/* nothing to scan until the thread runs */
+	TC->StackTop = Bottom;
+	TC->StackBottom = Bottom;
+	pthread_mutex_unlock(&HeapLock);
+	unparkThread(TC);
+	Arg = TC->StartArg;
+	TC->StartArg = NULL;
+	return Fn(Arg);
+}
+
+/* Every thread of the application is registered before it
+ * starts, so that a collection waits for it and scans its
+ * stack even if it never allocates. Until it runs, its
+ * argument is a root.
+ */
+int pthread_create(pthread_t *Thread, const pthread_attr_t *Attr,
+	void *(*Fn)(void*), void *Arg)
+{
+	getThreadCache();
+	ThreadStart *Start = malloc(sizeof(ThreadStart));
+	if (Start == NULL)
+	{
+		printf("Unable to allocate thread start\n");
+		exit(0);
+	}
+	ThreadCache *TC = allocThreadCache();
+	TC->Parked = 1;
+	TC->StartArg = Arg;
+	Start->Fn = Fn;
+	Start->TC = TC;
+
+	lockHeap();
+	TC->Next = ThreadCaches;
+	ThreadCaches = TC;
+	unlockHeap();
+
+	int Ret = getRealPthreadCreate()(Thread, Attr, startThread, Start);
+	if (Ret != 0)
 	{
-		char *Name = Strtab + Shdr[i].sh_name;
-		if (!strncmp(Name, ".data", 6))
+		ThreadCache **Prev;
+
+		lockHeap();
+		for (Prev = &ThreadCaches; *Prev != TC; Prev = &(*Prev)->Next)
 		{
-			DsecSz = Shdr[i].sh_size;
+			assert(*Prev != NULL);
 		}
+		*Prev = TC->Next;
+		unlockHeap();
+		free(TC);
+		free(Start);
 	}
+	return Ret;
+}
 
-out:
-	munmap(Base, Statbuf.st_size);
-	close(fd);
-	return DsecSz;
+typedef struct ThreadJoin
+{
+	pthread_t Thread;
+	void **Ret;
+	int Err;
+} ThreadJoin;
+
+static void* joinThread(void *Arg)
+{
+	static int (*RealJoin)(pthread_t, void**) = NULL;
+	ThreadJoin *Join = (ThreadJoin*)Arg;
+
+	if (RealJoin == NULL)
+	{
+		RealJoin = (int (*)(pthread_t, void**))dlsym(RTLD_NEXT, "pthread_join");
+		if (RealJoin == NULL)
+		{
+			printf("Unable to find pthread_join\n");
+			exit(0);
+		}
+	}
+	Join->Err = RealJoin(Join->Thread, Join->Ret);
+	return NULL;
 }
 
+/* a joining thread waits for one that may be stopped by a
+ * collection, so it must not hold the collection up */
+int pthread_join(pthread_t Thread, void **Ret)
+{
+	ThreadJoin Join;
 
+	Join.Thread = Thread;
+	Join.Ret = Ret;
+	Join.Err = 0;
+	callBlocking(joinThread, &Join);
+	return Join.Err;
+}
 
-void _runGC()
+/* bytes an object of Size bytes takes in the heap */
+static size_t getAllocSize(size_t Size)
 {
-	NumGCTriggered++;
+	if (Size <= MAX_HEADERLESS_SIZE && useHeaderless())
+	{
+		return Align(Size, 8);
+	}
+	return Align(Size, 8) + OBJ_HEADER_SIZE;
+}
 
-	size_t DataSecSz = getDataSecSz();
-	unsigned *DataStart;
+/* With headerless objects on, every object with a header takes
+ * more than MAX_HEADERLESS_SIZE bytes, so the size alone picks
+ * the kind of page.
+ */
+static void* SmallAlloc(ThreadCache *TC, size_t AlignedSize, int PointerFree)
+{
+	unsigned Class;
 
-	if (DataSecSz == -1)
+	if (AlignedSize <= MAX_HEADERLESS_SIZE && useHeaderless())
 	{
-		DataStart = (unsigned*)Align(((ulong64)&etext), 4);
+		Class = FIRST_HEADERLESS_CLASS + AlignedSize / 8 - 1;
 	}
 	else
 	{
-		DataStart = (unsigned*)Align(((ulong64)(&edata - DataSecSz)), 4);
+		Class = getSizeClass(AlignedSize);
+		if (PointerFree)
+		{
+			Class += NUM_SIZE_CLASSES;
+		}
 	}
-	unsigned *DataEnd = (unsigned*)((ulong64)(&edata) - 7);
-
-	/* scan global variables */
-	scanRoots(DataStart, DataEnd);
-
-	unsigned *UnDataStart = (unsigned*)Align(((ulong64)&edata), 4);
-	unsigned *UnDataEnd = (unsigned*)((ulong64)(&end) - 7);
-
-	/* scan uninitialized global variables */
-	scanRoots(UnDataStart, UnDataEnd);
+	TC->AllocSinceFlush += AlignedSize;
+	if (TC->FreeLists[Class] == NULL)
+	{
+		lockHeap();
+		checkAndRunGC(TC->AllocSinceFlush);
+		TC->AllocSinceFlush = 0;
+		refillCache(TC, Class);
+		unlockHeap();
+	}
+	ObjHeader *Header = (ObjHeader*)TC->FreeLists[Class];
+	char *Obj = (char*)Header + getSlotHeaderSize(Class);
+	assert(isObjFree(Header));
+	TC->FreeLists[Class] = *(char**)Obj;
 
-	
-	int Lvar;
-	void *Base;
-	size_t Size;
-	pthread_attr_t Attr;
-	
-	int Ret = pthread_getattr_np(pthread_self(), &Attr);
-	if (Ret != 0)
+	if (isHeaderlessClass(Class))
 	{
-		printf("Error getting stackinfo\n");
-		return;
+		char *Page = ADDR_TO_PAGE(Header);
+		unsigned Slot = getSlotIndex(Header, Class);
+		getTypeIndexes(Page, Class)[Slot] = UNTYPED_INDEX;
+		__atomic_fetch_and(&getFreeBits(Page)[Slot / 64], ~(1ULL << (Slot % 64)), __ATOMIC_RELAXED);
 	}
-	Ret = pthread_attr_getstack(&Attr , &Base, &Size);
-	if (Ret != 0)
+	else
 	{
-		printf("Error getting stackinfo\n");
-		return;
+		Header->Size = AlignedSize;
+		Header->Status = 0;
+		Header->Alignment = 0;
+		Header->Type = 0;
 	}
-	unsigned *Bottom = (unsigned*)(Base + Size - 7);
-	unsigned *Top = (unsigned*)&Lvar;
-	Top = (unsigned*)Align((ulong64)Top, 4);
-	/* skip GC stack frame */
-	while (Top[0] != MAGIC_ADDR)
+	memset(Obj, 0, SizeClasses[Class] - getSlotHeaderSize(Class));
+	if (MarkingActive)
 	{
-		assert(Top < Bottom);
-		Top++;
+		setMark(Header);
 	}
-	/* scan application stack */
-	scanRoots(Top, Bottom);
-
-	scanner();
-	sweep();
+	return Obj;
 }
 
-static void checkAndRunGC(size_t Sz)
+static void* allocObj(size_t Size, int PointerFree)
 {
-	static size_t TotalAlloc = 0;
+	size_t AlignedSize = getAllocSize(Size);
+	ThreadCache *TC = getThreadCache();
 
-	TotalAlloc += Sz;
-	if (TotalAlloc < GC_THRESHOLD)
+	TC->NumBytesAllocated += AlignedSize;
+	TC->SampleBytesLeft -= AlignedSize;
+	if (AlignedSize > MAX_SMALL_SIZE)
 	{
-		return;
+		lockHeap();
+		checkAndRunGC(TC->AllocSinceFlush + AlignedSize);
+		TC->AllocSinceFlush = 0;
+		lazySweep(Align(AlignedSize, PAGE_SIZE) / PAGE_SIZE * LAZY_SWEEP_RATIO);
+		void *Obj = BigAlloc(Size);
+		if (MarkingActive)
+		{
+			setMark((ObjHeader*)((char*)Obj - OBJ_HEADER_SIZE));
+		}
+		unlockHeap();
+		return Obj;
+	}
+	assert(Size != 0);
+	assert(sizeof(struct OtherMetadata) <= OTHER_METADATA_SIZE);
+
+	return SmallAlloc(TC, AlignedSize, PointerFree);
+}
+
+void *_mymalloc(size_t Size)
+{
+	void *Obj = allocObj(Size, 0);
+	if (MyCache->SampleBytesLeft < 0)
+	{
+		sampleAllocation(MyCache, getAllocSize(Size), 0);
 	}
-	TotalAlloc = 0;
-	_runGC();
+	return Obj;
 }
 
-void printMemoryStats()
+/* allocate an object whose layout is known at the call site.
+ * Objects without pointer fields go to the pointer-free pages.
+ */
+void *_mymallocTyped(size_t Size, unsigned long long Type)
 {
-	printf("Num Bytes Allocated: %lld\n", NumBytesAllocated);
-	printf("Num Bytes Freed: %lld\n", NumBytesFreed);
-	printf("Num GC Triggered: %lld\n", NumGCTriggered);
+	void *Obj = allocObj(Size, Type == 0);
+	SetType(Obj, Type);
+	if (MyCache->SampleBytesLeft < 0)
+	{
+		sampleAllocation(MyCache, getAllocSize(Size), Type);
+	}
+	return Obj;
 }
 
-static ObjHeader* ObjToHeader(void *Obj) { return (ObjHeader*)((char*)Obj - OBJ_HEADER_SIZE); }
+void* GetObjBase(void *Ptr)
+{
+	ObjHeader *Header = findObjHeader(Ptr);
+	if (Header == NULL)
+	{
+		return NULL;
+	}
+	return getObjPayload(Header);
+}
 
 unsigned GetSize(void *Obj)
 {
 	ObjHeader *Header = ObjToHeader(Obj);
-	return Header->Size - OBJ_HEADER_SIZE;
+	return (char*)Header + getObjSize(Header) - (char*)Obj;
 }
 
 unsigned long long GetType(void *Obj)
 {
-	ObjHeader *Header = ObjToHeader(Obj);
-	return Header->Type;
+	ulong64 Type;
+	getObjType(ObjToHeader(Obj), &Type);
+	return Type;
+}
+
+/* zero for objects that are scanned conservatively */
+int IsTyped(void *Obj)
+{
+	ulong64 Type;
+	return getObjType(ObjToHeader(Obj), &Type);
 }
 
+/* from now on the collector scans only the pointer
+ * slots of the object. A headerless object gets the
+ * index of its type in the type table. */
 void SetType(void *Obj, unsigned long long Type)
 {
+	if (isHeaderless(Obj))
+	{
+		unsigned Class = getPageInfo(Obj)->Class;
+		unsigned short *Indexes = getTypeIndexes(ADDR_TO_PAGE(Obj), Class);
+		__atomic_store_n(&Indexes[getSlotIndex((ObjHeader*)Obj, Class)], internType(Type), __ATOMIC_RELEASE);
+		return;
+	}
 	ObjHeader *Header = ObjToHeader(Obj);
 	Header->Type = Type;
+	__atomic_fetch_or(&Header->Status, TYPED, __ATOMIC_RELEASE);
 }
 
+/* headerless objects stay in place, nothing to record */
 void* GetAlignedAddr(void *Addr, size_t Alignment)
 {
-	ObjHeader *Header = ObjToHeader(Addr);
-	Header->Alignment = Alignment;
+	if (!isHeaderless(Addr))
+	{
+		ObjToHeader(Addr)->Alignment = Alignment;
+	}
 	return (void*)Align((size_t)(Addr), Alignment);
 }
 
@@ -3,9 +3,74 @@
 
 #include <stddef.h>
 
+/* kinds of collections */
+#define GC_FULL 0
+#define GC_MINOR 1
+#define GC_CONCURRENT 2
+
+/* phases of a collection: finishing the sweep of the previous
+ * one, collecting the roots (and the dirty cards of a minor GC),
+ * marking, compacting, and returning empty pages to the OS */
+#define GC_PHASE_SWEEP 0
+#define GC_PHASE_ROOTS 1
+#define GC_PHASE_MARK 2
+#define GC_PHASE_COMPACT 3
+#define GC_PHASE_DECOMMIT 4
+#define NUM_GC_PHASES 5
+
+/* bucket i counts the pauses of [2^(i-1), 2^i) microseconds */
+#define NUM_PAUSE_BUCKETS 32
+
+typedef struct GCEvent
+{
+	int Kind;
+	long long StartNs;
+	long long EndNs;
+	long long PauseNs;
+	long long PhaseStartNs[NUM_GC_PHASES];
+	long long PhaseNs[NUM_GC_PHASES];
+	long long BytesMarked;
+	long long ObjectsMarked;
+	/* bytes live after the last collection plus those
+	 * allocated since, and bytes found live */
+	long long HeapBefore;
+	long long HeapAfter;
+} GCEvent;
+
+typedef struct GCStats
+{
+	long long NumGCs;
+	long long NumMinorGCs;
+	long long BytesAllocated;
+	long long BytesFreed;
+	long long BytesDecommitted;
+	long long PauseTimeNs;
+	long long MaxPauseNs;
+	long long PhaseNs[NUM_GC_PHASES];
+	long long BytesMarked;
+	long long ObjectsMarked;
+	long long HeapSize;
+	long long PauseHistogram[NUM_PAUSE_BUCKETS];
+} GCStats;
+
 void *mymalloc(size_t Size);
+/* The collector trusts Type (see SetType) and scans only the
+ * pointer slots it has, so it must come from an analysis of
+ * every use of the object, as TypeAssigner makes. */
+void *mymallocTyped(size_t Size, unsigned long long Type);
 void printMemoryStats();
+void getGCStats(GCStats *Stats);
+int getGCEvents(GCEvent *Events, int Max);
+void writeAllocProfile(const char *Path);
 void runGC();
+void safepointPoll();
+/* Threads are registered when pthread_create starts them, and a
+ * collection stops every registered thread at its next safepoint
+ * poll or allocation and scans its stack. A thread that waits or
+ * runs for long outside instrumented code must do so through
+ * callBlocking, or the collection waits for it; pthread_join
+ * already does. */
+void* callBlocking(void *(*Fn)(void*), void *Arg);
 unsigned GetSize(void *Obj);
 unsigned long long GetType(void *Obj);
 void SetType(void *Obj, unsigned long long Type);
@@ -0,0 +1,18 @@
+#ifndef __OBJHEADER_H
+#define __OBJHEADER_H
+
+/* Header in front of the objects that have one. The HeapToStack
+ * pass lays out the same header in front of the objects it moves
+ * to the stack, so this file is also included by the compiler.
+ */
+typedef struct ObjHeader
+{
+	unsigned Size;
+	unsigned short Status;
+	unsigned short Alignment;
+	unsigned long long Type;
+} ObjHeader;
+
+#define OBJ_HEADER_SIZE (sizeof(ObjHeader))
+
+#endif
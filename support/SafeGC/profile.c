@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <execinfo.h>
+#include "memory.h"
+#include "heap.h"
+#include "marker.h"
+
+#define MAX_SAMPLE_FRAMES 8
+#define MAX_SAMPLE_SITES 4096
+
+/* Allocation sampling (SAFEGC_SAMPLE_BYTES=N): about one
+ * allocation every N bytes is sampled, with the gaps drawn from
+ * an exponential distribution so that the samples form a Poisson
+ * process over the allocated bytes. An object of S bytes is then
+ * sampled with probability 1 - exp(-S/N), and each sample stands
+ * for the inverse of that many objects. The samples are aggregated
+ * by call stack. With sampling off, the countdown never expires.
+ */
+typedef struct SampleSite
+{
+	void *Frames[MAX_SAMPLE_FRAMES];
+	unsigned NumFrames;
+	unsigned long long Type;
+	long long NumSamples;
+	long long SampledBytes;
+	double EstimatedBytes;
+	double EstimatedObjects;
+} SampleSite;
+
+static long long SampleInterval = -1;
+static SampleSite *SampleSites = NULL;
+static unsigned NumSampleSites = 0;
+static long long NumDroppedSamples = 0;
+static pthread_mutex_t SampleLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long nextSampleInterval(ThreadCache *TC)
+{
+	ulong64 X = TC->SampleSeed;
+
+	X ^= X << 13;
+	X ^= X >> 7;
+	X ^= X << 17;
+	TC->SampleSeed = X;
+	/* U in (0, 1] */
+	double U = ((X >> 38) + 1) / (double)(1 << 26);
+	return (long long)(-log(U) * SampleInterval) + 1;
+}
+
+/* Walk the caller frames of a mymalloc wrapper. The wrapper
+ * frame is found through the marker it pushes, MARKER_TO_FRAME
+ * bytes below its frame pointer; the frames above it are followed through
+ * their frame pointers for as long as they stay on the stack, so
+ * the application needs -fno-omit-frame-pointer for more than
+ * the allocation site.
+ */
+static unsigned getAllocationStack(ThreadCache *TC, void **Frames)
+{
+	int Lvar;
+	unsigned *Top = (unsigned*)Align((ulong64)&Lvar, 4);
+	unsigned *Bottom = TC->StackBottom;
+	unsigned NumFrames = 0;
+	unsigned Words;
+
+	if (Bottom == NULL)
+	{
+		return 0;
+	}
+	for (Words = 0; Top[0] != MAGIC_ADDR; Words++, Top++)
+	{
+		if (Top >= Bottom || Words > 1024)
+		{
+			return 0;
+		}
+	}
+	void **Frame = (void**)((char*)Top + MARKER_TO_FRAME);
+	Frames[NumFrames++] = Frame[1];
+	while (NumFrames < MAX_SAMPLE_FRAMES)
+	{
+		void **Next = (void**)Frame[0];
+		if (Next <= Frame || (void*)(Next + 2) > (void*)Bottom || ((ulong64)Next & 7) != 0
+			|| Next[1] == NULL)
+		{
+			break;
+		}
+		Frame = Next;
+		Frames[NumFrames++] = Frame[1];
+	}
+	return NumFrames;
+}
+
+/* Sites already in the table keep collecting samples; a new site
+ * is added only while the table is at most half full, to keep
+ * the probe sequences short. */
+static SampleSite* findSampleSite(void **Frames, unsigned NumFrames)
+{
+	ulong64 Hash = NumFrames;
+	unsigned Idx;
+	unsigned Probe;
+
+	for (Idx = 0; Idx < NumFrames; Idx++)
+	{
+		Hash = (Hash ^ (ulong64)Frames[Idx]) * 0x9E3779B97F4A7C15ULL;
+	}
+	for (Probe = 0; Probe < MAX_SAMPLE_SITES; Probe++)
+	{
+		SampleSite *Site = &SampleSites[(Hash + Probe) % MAX_SAMPLE_SITES];
+		if (Site->NumSamples == 0)
+		{
+			if (NumSampleSites >= MAX_SAMPLE_SITES / 2)
+			{
+				return NULL;
+			}
+			memcpy(Site->Frames, Frames, NumFrames * sizeof(void*));
+			Site->NumFrames = NumFrames;
+			NumSampleSites++;
+			return Site;
+		}
+		if (Site->NumFrames == NumFrames
+			&& memcmp(Site->Frames, Frames, NumFrames * sizeof(void*)) == 0)
+		{
+			return Site;
+		}
+	}
+	return NULL;
+}
+
+void __attribute__((noinline)) sampleAllocation(ThreadCache *TC, size_t Size, unsigned long long Type)
+{
+	void *Frames[MAX_SAMPLE_FRAMES];
+	unsigned NumFrames = getAllocationStack(TC, Frames);
+	double Weight = 1 / (1 - exp(-(double)Size / SampleInterval));
+
+	TC->SampleBytesLeft = nextSampleInterval(TC);
+	pthread_mutex_lock(&SampleLock);
+	SampleSite *Site = findSampleSite(Frames, NumFrames);
+	if (Site == NULL)
+	{
+		NumDroppedSamples++;
+	}
+	else
+	{
+		Site->Type = Type;
+		Site->NumSamples++;
+		Site->SampledBytes += Size;
+		Site->EstimatedBytes += Weight * Size;
+		Site->EstimatedObjects += Weight;
+	}
+	pthread_mutex_unlock(&SampleLock);
+}
+
+static int compareSites(const void *A, const void *B)
+{
+	const SampleSite *SA = *(SampleSite* const*)A;
+	const SampleSite *SB = *(SampleSite* const*)B;
+	if (SA->EstimatedBytes == SB->EstimatedBytes)
+	{
+		return 0;
+	}
+	return (SA->EstimatedBytes > SB->EstimatedBytes) ? -1 : 1;
+}
+
+/* write the sampled sites, heaviest first, with their stacks
+ * symbolized where the dynamic symbol table allows it (link
+ * with -rdynamic); the addresses can be fed to addr2line */
+void writeAllocProfile(const char *Path)
+{
+	FILE *F = (Path == NULL) ? stdout : fopen(Path, "w");
+	SampleSite **Sorted;
+	unsigned Num = 0;
+	unsigned Idx;
+	unsigned Frame;
+
+	if (F == NULL)
+	{
+		printf("Unable to open %s\n", Path);
+		return;
+	}
+	pthread_mutex_lock(&SampleLock);
+	fprintf(F, "SafeGC allocation profile: one sample per %lld bytes, %u sites, %lld samples dropped\n",
+		SampleInterval, NumSampleSites, NumDroppedSamples);
+	Sorted = malloc((NumSampleSites + 1) * sizeof(SampleSite*));
+	if (Sorted == NULL || SampleSites == NULL)
+	{
+		pthread_mutex_unlock(&SampleLock);
+		free(Sorted);
+		if (F != stdout)
+		{
+			fclose(F);
+		}
+		return;
+	}
+	for (Idx = 0; Idx < MAX_SAMPLE_SITES; Idx++)
+	{
+		if (SampleSites[Idx].NumSamples > 0)
+		{
+			Sorted[Num++] = &SampleSites[Idx];
+		}
+	}
+	qsort(Sorted, Num, sizeof(SampleSite*), compareSites);
+	for (Idx = 0; Idx < Num; Idx++)
+	{
+		SampleSite *Site = Sorted[Idx];
+		char **Symbols = backtrace_symbols(Site->Frames, Site->NumFrames);
+		fprintf(F, "\n%.0f bytes in %.0f objects (%lld samples, %lld bytes sampled), type 0x%llx\n",
+			Site->EstimatedBytes, Site->EstimatedObjects, Site->NumSamples,
+			Site->SampledBytes, Site->Type);
+		for (Frame = 0; Frame < Site->NumFrames; Frame++)
+		{
+			fprintf(F, "    #%u %p %s\n", Frame, Site->Frames[Frame],
+				(Symbols != NULL) ? Symbols[Frame] : "");
+		}
+		free(Symbols);
+	}
+	pthread_mutex_unlock(&SampleLock);
+	free(Sorted);
+	if (F != stdout)
+	{
+		fclose(F);
+	}
+}
+
+static void writeAllocProfileAtExit()
+{
+	writeAllocProfile(getenv("SAFEGC_ALLOC_PROFILE"));
+}
+
+/* SAFEGC_ALLOC_PROFILE names the file that gets the
+ * profile at exit */
+void initSampling(ThreadCache *TC)
+{
+	pthread_mutex_lock(&SampleLock);
+	if (SampleInterval == -1)
+	{
+		char *Env = getenv("SAFEGC_SAMPLE_BYTES");
+		SampleInterval = 0;
+		if (Env != NULL && atoll(Env) > 0)
+		{
+			SampleInterval = atoll(Env);
+			SampleSites = calloc(MAX_SAMPLE_SITES, sizeof(SampleSite));
+			if (SampleSites == NULL)
+			{
+				printf("Unable to allocate sample sites\n");
+				exit(0);
+			}
+			if (getenv("SAFEGC_ALLOC_PROFILE") != NULL)
+			{
+				atexit(writeAllocProfileAtExit);
+			}
+		}
+	}
+	pthread_mutex_unlock(&SampleLock);
+
+	TC->SampleSeed = ((ulong64)TC ^ (ulong64)getTimeNs()) | 1;
+	TC->SampleBytesLeft = (SampleInterval > 0) ? nextSampleInterval(TC) : LLONG_MAX;
+}
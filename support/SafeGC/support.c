@@ -4,10 +4,115 @@
 #include <assert.h>
 #include <unistd.h>
 #include "memory.h"
+#include "heap.h"
 #include "support.h"
 
+#define TYPE_CACHE_SIZE 256
+
+/* A type bitmap has one bit per 8-byte slot, set for
+ * pointer slots, followed by a terminating bit at the
+ * position equal to the number of slots in the type.
+ */
+typedef struct TypeCacheEntry
+{
+	unsigned long long SrcType;
+	unsigned long long DstType;
+	unsigned long long Offset;
+} TypeCacheEntry;
+
+/* per-thread direct-mapped cache of validated casts */
+static __thread TypeCacheEntry TypeCache[TYPE_CACHE_SIZE];
+
+static unsigned getTypeSlots(unsigned long long Type)
+{
+	return 63 - __builtin_clzll(Type);
+}
+
+static unsigned getTypeCacheIndex(unsigned long long SrcType,
+	unsigned long long DstType, unsigned long long Offset)
+{
+	unsigned long long Hash = SrcType * 0x9E3779B97F4A7C15ULL;
+	Hash ^= DstType * 0xC2B2AE3D27D4EB4FULL;
+	Hash ^= Offset;
+	return (Hash >> 32) & (TYPE_CACHE_SIZE - 1);
+}
+
+/* Compare the pointer slots of the destination type against
+ * the source layout starting at Offset. The source layout
+ * repeats for arrays of structs, so the source slot index
+ * wraps around at the number of slots in the source type.
+ */
+static int isCompatibleType(unsigned long long SrcType,
+	unsigned long long DstType, unsigned long long Offset)
+{
+	if (SrcType == 0 || (Offset & 7))
+	{
+		return 0;
+	}
+	unsigned SrcSlots = getTypeSlots(SrcType);
+	unsigned DstSlots = getTypeSlots(DstType);
+	unsigned SrcSlot = (Offset / 8) % SrcSlots;
+	unsigned i;
+
+	for (i = 0; i < DstSlots; i++)
+	{
+		if (((DstType >> i) & 1) != ((SrcType >> SrcSlot) & 1))
+		{
+			return 0;
+		}
+		SrcSlot++;
+		if (SrcSlot == SrcSlots)
+		{
+			SrcSlot = 0;
+		}
+	}
+	return 1;
+}
+
 void checkTypeInv(void *Src, unsigned long long DstType)
 {
+	if (DstType == 0)
+	{
+		/* destination has no pointer fields */
+		return;
+	}
+
+	void *Base = GetObjBase(Src);
+	if (Base == NULL)
+	{
+		/* not a heap object */
+		return;
+	}
+	if (!IsTyped(Base))
+	{
+		/* never cast: scanned conservatively, any layout fits */
+		return;
+	}
+	unsigned long long SrcType = GetType(Base);
+	if (Base == Src && SrcType == DstType)
+	{
+		/* a cast of an object to its own type */
+		return;
+	}
+
+	unsigned long long Offset = (char*)Src - (char*)Base;
+	TypeCacheEntry *Entry = &TypeCache[getTypeCacheIndex(SrcType, DstType, Offset)];
+	if (Entry->SrcType == SrcType && Entry->DstType == DstType
+		&& Entry->Offset == Offset)
+	{
+		return;
+	}
+
+	if (!isCompatibleType(SrcType, DstType, Offset))
+	{
+		printf("Invalid obj type: src_type:%llx dst_type:%llx offset:%llx\n",
+			SrcType, DstType, Offset);
+		exit(0);
+	}
+
+	Entry->SrcType = SrcType;
+	Entry->DstType = DstType;
+	Entry->Offset = Offset;
 }
 
 void checkSizeInv(void *Dst, unsigned DstSize)
@@ -47,11 +152,32 @@ void BoundsCheckWithSize(void *RealBase, void *Ptr, size_t Size, size_t AccessSi
 {
 }
 
+/* While the collector marks concurrently, the pointers about to
+ * be overwritten are logged so that the snapshot taken at the
+ * start of marking stays reachable. In generational mode the
+ * cards of the written bytes are dirtied.
+ */
 void WriteBarrier(void *Base, void *Ptr, size_t AccessSize)
 {
+	if (__atomic_load_n(&MarkingActive, __ATOMIC_ACQUIRE))
+	{
+		recordOverwrite(Ptr, AccessSize);
+	}
+	if (CardMarkingActive)
+	{
+		dirtyCards(Ptr, AccessSize);
+	}
 }
 
 void WriteBarrierWithSize(void *RealBase, void *Ptr, size_t Size,
 	size_t AccessSize, unsigned long long Type)
 {
+	if (__atomic_load_n(&MarkingActive, __ATOMIC_ACQUIRE))
+	{
+		recordOverwrite(Ptr, AccessSize);
+	}
+	if (CardMarkingActive)
+	{
+		dirtyCards(Ptr, AccessSize);
+	}
 }
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include "memory.h"
+#include "heap.h"
+
+#define MAX_SWEEP_THREADS 64
+/* pages claimed at a time by a background sweeper */
+#define SWEEP_BATCH 32
+
+long long NumPagesSweptEagerly = 0;
+long long NumPagesSweptLazily = 0;
+long long NumPagesSweptInBackground = 0;
+
+/* set when the pages are queued after a minor collection */
+static int MinorSweep = 0;
+
+/* pages between the sweep pointer and the sweep limit
+ * still hold the marks of the last GC. After a minor
+ * collection, the old pages are not swept again.
+ */
+int isUnswept(char *Page)
+{
+	Segment *Seg = ADDR_TO_SEGMENT(Page);
+	if (!getBigAlloc(Seg) && (getPageInfo(Page)->Flags & PAGE_SWEEPING))
+	{
+		return 1;
+	}
+	if (MinorSweep && !getBigAlloc(Seg))
+	{
+		PageInfo *Info = getPageInfo(Page);
+		if (Info->Class != NO_CLASS && (Info->Flags & PAGE_NURSERY) == 0)
+		{
+			return 0;
+		}
+	}
+	return Page >= getSweepPtr(Seg) && Page < getSweepLimit(Seg);
+}
+
+/* free the unmarked objects on a page and rebuild the
+ * free list of the page. The mark bits of the page are
+ * read a word at a time: fully live pages are left alone
+ * and the headers of live objects are never touched.
+ * Returns the number of bytes freed.
+ */
+static size_t sweepPageSlots(char *Page)
+{
+	PageInfo *Info = getPageInfo(Page);
+	unsigned ClassSize = SizeClasses[Info->Class];
+	unsigned NumSlots = getNumSlots(Info->Class);
+	unsigned First = getFirstSlot(Info->Class);
+	unsigned Link = getSlotHeaderSize(Info->Class);
+	ulong64 LiveSlots[(PAGE_SIZE/GRANULE_SIZE + 63) / 64] = { 0 };
+	unsigned NumLive = 0;
+	size_t Freed = 0;
+	ulong64 Bit;
+	ulong64 *Words = getMarkWord(Page, &Bit);
+	unsigned Idx;
+	int Slot;
+
+	assert((Info->Flags & PAGE_LISTED) == 0);
+	/* the marked survivors are old now */
+	Info->Flags &= ~PAGE_NURSERY;
+	for (Idx = 0; Idx < PAGE_MARK_WORDS; Idx++)
+	{
+		NumLive += __builtin_popcountll(Words[Idx]);
+	}
+	Info->FreeList = NULL;
+	Info->NumFree = 0;
+	if (NumLive == NumSlots)
+	{
+		return 0;
+	}
+	for (Idx = 0; Idx < PAGE_MARK_WORDS; Idx++)
+	{
+		ulong64 Word = Words[Idx];
+		while (Word != 0)
+		{
+			unsigned Granule = Idx * 64 + __builtin_ctzll(Word);
+			Word &= Word - 1;
+			Slot = (Granule * GRANULE_SIZE - First) / ClassSize;
+			LiveSlots[Slot / 64] |= 1ULL << (Slot % 64);
+		}
+	}
+
+	for (Slot = NumSlots - 1; Slot >= 0; Slot--)
+	{
+		if (LiveSlots[Slot / 64] & (1ULL << (Slot % 64)))
+		{
+			continue;
+		}
+		ObjHeader *Header = (ObjHeader*)getSlot(Page, Info->Class, Slot);
+		if (!isObjFree(Header))
+		{
+			Freed += getObjSize(Header);
+			setObjFree(Header, 1);
+		}
+		*(char**)((char*)Header + Link) = Info->FreeList;
+		Info->FreeList = (char*)Header;
+		Info->NumFree++;
+	}
+	return Freed;
+}
+
+/* empty pages are reclaimed and partially free ones go
+ * to the partial list of their class */
+static void finishPageSweep(char *Page)
+{
+	PageInfo *Info = getPageInfo(Page);
+
+	if (Info->NumFree == getNumSlots(Info->Class))
+	{
+		releasePage(Page);
+	}
+	else if (Info->NumFree > 0)
+	{
+		listPage(Page);
+	}
+}
+
+static void sweepPage(char *Page)
+{
+	NumBytesFreed += sweepPageSlots(Page);
+	finishPageSweep(Page);
+}
+
+static void sweepBigPage(char *Page)
+{
+	ObjHeader *Header = (ObjHeader*)Page;
+
+	if (!isMarked(Header))
+	{
+		freeObj((char*)Header + OBJ_HEADER_SIZE);
+	}
+}
+
+/* reclaimed pages and the tail pages of big objects
+ * don't need sweeping. After a minor collection only
+ * the nursery pages can hold unmarked objects.
+ */
+static int needsSweep(Segment *Seg, char *Page)
+{
+	if (getBigAlloc(Seg))
+	{
+		unsigned short *SzMeta = getSizeMetadata(Page);
+		return SzMeta[0] == 1;
+	}
+	PageInfo *Info = getPageInfo(Page);
+	if (MinorSweep && (Info->Flags & PAGE_NURSERY) == 0)
+	{
+		return 0;
+	}
+	return Info->Class != NO_CLASS;
+}
+
+static void sweepPageOf(Segment *Seg, char *Page)
+{
+	if (getBigAlloc(Seg))
+	{
+		sweepBigPage(Page);
+	}
+	else
+	{
+		sweepPage(Page);
+	}
+}
+
+/* Segment from which the next unswept page is taken.
+ * Segments created after the last GC sit in front of
+ * it in the segment list and have nothing to sweep.
+ */
+static SegmentList *SweepCursor = NULL;
+
+/* take the next page that needs sweeping off the
+ * unswept range, with the heap lock held */
+static char* claimNextPage()
+{
+	while (SweepCursor != NULL)
+	{
+		Segment *Seg = SweepCursor->Segment;
+		char *Page = getSweepPtr(Seg);
+		while (Page < getSweepLimit(Seg))
+		{
+			setSweepPtr(Seg, Page + PAGE_SIZE);
+			if (!getBigAlloc(Seg) && (getPageInfo(Page)->Flags & PAGE_SKIP_SWEEP))
+			{
+				getPageInfo(Page)->Flags &= ~PAGE_SKIP_SWEEP;
+			}
+			else if (needsSweep(Seg, Page))
+			{
+				return Page;
+			}
+			Page += PAGE_SIZE;
+		}
+		SweepCursor = SweepCursor->Next;
+	}
+	return NULL;
+}
+
+static int sweepNextPage()
+{
+	char *Page = claimNextPage();
+	if (Page == NULL)
+	{
+		return 0;
+	}
+	sweepPageOf(ADDR_TO_SEGMENT(Page), Page);
+	return 1;
+}
+
+/* Background sweeping (SAFEGC_SWEEP_THREADS=N, off by
+ * default): after each collection, N threads claim batches of
+ * unswept pages under the heap lock, the same way the lazy
+ * sweep does, and sweep them without it. The mutators leave a
+ * page alone while PAGE_SWEEPING is set. Swept pages come back
+ * on a lock-free stack and are listed or released by the next
+ * thread that sweeps or refills its cache under the lock.
+ */
+static int NumSweepThreads = -1;
+static pthread_t SweepThreads[MAX_SWEEP_THREADS];
+static unsigned SweepRequests = 0;
+static pthread_mutex_t SweepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SweepStart = PTHREAD_COND_INITIALIZER;
+/* swept pages, linked through PageInfo.Next */
+static char *SweptPages = NULL;
+static long long SweptBytesFreed = 0;
+/* batches claimed and not yet handed back */
+static int SweepsInFlight = 0;
+
+static int getNumSweepThreads()
+{
+	if (NumSweepThreads == -1)
+	{
+		char *Env = getenv("SAFEGC_SWEEP_THREADS");
+		NumSweepThreads = 0;
+		if (Env != NULL && atoi(Env) > 0)
+		{
+			NumSweepThreads = atoi(Env);
+		}
+		if (NumSweepThreads > MAX_SWEEP_THREADS)
+		{
+			NumSweepThreads = MAX_SWEEP_THREADS;
+		}
+	}
+	return NumSweepThreads;
+}
+
+/* called with the heap lock held */
+void publishSweptPages()
+{
+	char *Page = __atomic_exchange_n(&SweptPages, NULL, __ATOMIC_ACQUIRE);
+
+	while (Page != NULL)
+	{
+		PageInfo *Info = getPageInfo(Page);
+		char *Next = Info->Next;
+		Info->Flags &= ~PAGE_SWEEPING;
+		finishPageSweep(Page);
+		Page = Next;
+	}
+	NumBytesFreed += __atomic_exchange_n(&SweptBytesFreed, 0, __ATOMIC_RELAXED);
+}
+
+/* wait for the batches the background sweepers have claimed
+ * and hand their pages back; called with the heap lock held,
+ * which keeps the sweepers from claiming more */
+void finishBackgroundSweeps()
+{
+	while (__atomic_load_n(&SweepsInFlight, __ATOMIC_ACQUIRE) > 0)
+	{
+		sched_yield();
+	}
+	publishSweptPages();
+}
+
+/* claim and sweep a batch of pages, returns 0 once
+ * nothing is left to sweep */
+static int sweepBatch()
+{
+	char *Batch[SWEEP_BATCH];
+	unsigned Num = 0;
+	unsigned Idx;
+	int Claimed = 0;
+	size_t Freed = 0;
+
+	lockHeap();
+	publishSweptPages();
+	while (Num < SWEEP_BATCH)
+	{
+		char *Page = claimNextPage();
+		if (Page == NULL)
+		{
+			break;
+		}
+		Claimed = 1;
+		if (getBigAlloc(ADDR_TO_SEGMENT(Page)))
+		{
+			/* a mark bit check, done in place */
+			sweepBigPage(Page);
+			continue;
+		}
+		getPageInfo(Page)->Flags |= PAGE_SWEEPING;
+		Batch[Num++] = Page;
+	}
+	if (Num > 0)
+	{
+		__atomic_fetch_add(&SweepsInFlight, 1, __ATOMIC_RELAXED);
+	}
+	unlockHeap();
+
+	if (Num == 0)
+	{
+		return Claimed;
+	}
+	for (Idx = 0; Idx < Num; Idx++)
+	{
+		char *Page = Batch[Idx];
+		PageInfo *Info = getPageInfo(Page);
+		Freed += sweepPageSlots(Page);
+		Info->Next = __atomic_load_n(&SweptPages, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&SweptPages, &Info->Next, Page,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	__atomic_fetch_add(&SweptBytesFreed, Freed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&NumPagesSweptInBackground, Num, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&SweepsInFlight, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static void* sweepThread(void *Arg)
+{
+	unsigned Seen = 0;
+
+	while (1)
+	{
+		pthread_mutex_lock(&SweepLock);
+		while (SweepRequests == Seen)
+		{
+			pthread_cond_wait(&SweepStart, &SweepLock);
+		}
+		Seen = SweepRequests;
+		pthread_mutex_unlock(&SweepLock);
+
+		while (sweepBatch());
+	}
+	return NULL;
+}
+
+static void wakeSweepThreads()
+{
+	static int SweepersStarted = 0;
+	int Idx;
+
+	if (getNumSweepThreads() == 0)
+	{
+		return;
+	}
+	pthread_mutex_lock(&SweepLock);
+	if (!SweepersStarted)
+	{
+		for (Idx = 0; Idx < NumSweepThreads; Idx++)
+		{
+			if (createThread(&SweepThreads[Idx], sweepThread, NULL) != 0)
+			{
+				printf("Unable to create sweep thread\n");
+				exit(0);
+			}
+		}
+		SweepersStarted = 1;
+	}
+	SweepRequests++;
+	pthread_cond_broadcast(&SweepStart);
+	pthread_mutex_unlock(&SweepLock);
+}
+
+/* sweep up to NumPages pages on behalf of the allocator */
+void lazySweep(size_t NumPages)
+{
+	publishSweptPages();
+	while (NumPages > 0 && sweepNextPage())
+	{
+		NumPagesSweptLazily++;
+		NumPages--;
+	}
+}
+
+/* After marking, every page allocated so far is queued
+ * as unswept. The thread caches drop their pages, so that
+ * they only take slots from pages that are swept again.
+ */
+void queueUnsweptPages(int Minor)
+{
+	SegmentList *L;
+	ThreadCache *TC;
+	unsigned Class;
+
+	MinorSweep = Minor;
+	for (L = Segments; L != NULL; L = L->Next)
+	{
+		Segment *Seg = L->Segment;
+		setSweepPtr(Seg, getDataPtr(Seg));
+		setSweepLimit(Seg, getAllocPtr(Seg));
+	}
+	SweepCursor = Segments;
+
+	for (Class = 0; Class < NUM_CLASSES; Class++)
+	{
+		for (TC = ThreadCaches; TC != NULL; TC = TC->Next)
+		{
+			returnPage(TC, Class);
+		}
+		while (PartialPages[Class] != NULL)
+		{
+			PageInfo *Info = getPageInfo(PartialPages[Class]);
+			Info->Flags &= ~PAGE_LISTED;
+			PartialPages[Class] = Info->Next;
+		}
+	}
+	wakeSweepThreads();
+}
+
+/* Free all unmarked objects. */
+void sweep()
+{
+	long long Start = getTimeNs();
+
+	while (sweepNextPage())
+	{
+		NumPagesSweptEagerly++;
+	}
+	finishBackgroundSweeps();
+	endPhase(GC_PHASE_SWEEP, Start);
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "memory.h"
+#include "heap.h"
+
+/* collections kept for getGCEvents and the trace */
+#define MAX_GC_EVENTS 1024
+
+long long getTimeNs()
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return Now.tv_sec * 1000000000LL + Now.tv_nsec;
+}
+
+/* Telemetry: each collection records a GCEvent with the time
+ * spent in its phases, in a ring of the last MAX_GC_EVENTS.
+ * The phases of a concurrent cycle add up over its steps, and
+ * the background decommit is charged to the last collection.
+ * Lazy and background sweeping is spread over the mutators and
+ * is not timed.
+ */
+static GCEvent GCEvents[MAX_GC_EVENTS];
+static long long NumGCEvents = 0;
+static GCEvent *CurEvent = NULL;
+static long long PhaseTotalNs[NUM_GC_PHASES];
+static long long PauseHistogram[NUM_PAUSE_BUCKETS];
+static long long PauseTimeNs = 0;
+static long long MaxPauseNs = 0;
+static long long TotalBytesMarked = 0;
+static long long TotalObjectsMarked = 0;
+
+/* called with the heap lock held */
+void beginGCEvent(int Kind, size_t HeapBefore)
+{
+	GCEvent *Ev = &GCEvents[NumGCEvents % MAX_GC_EVENTS];
+
+	memset(Ev, 0, sizeof(GCEvent));
+	Ev->Kind = Kind;
+	Ev->StartNs = getTimeNs();
+	Ev->HeapBefore = HeapBefore;
+	NumGCEvents++;
+	CurEvent = Ev;
+}
+
+void endGCEvent(size_t HeapAfter)
+{
+	GCEvent *Ev = CurEvent;
+
+	Ev->EndNs = getTimeNs();
+	Ev->BytesMarked = getMarkedBytes();
+	Ev->ObjectsMarked = getMarkedObjects();
+	Ev->HeapAfter = HeapAfter;
+	TotalBytesMarked += Ev->BytesMarked;
+	TotalObjectsMarked += Ev->ObjectsMarked;
+}
+
+void endPhase(int Phase, long long Start)
+{
+	long long Now = getTimeNs();
+	GCEvent *Ev = CurEvent;
+
+	__atomic_fetch_add(&PhaseTotalNs[Phase], Now - Start, __ATOMIC_RELAXED);
+	if (Ev == NULL)
+	{
+		return;
+	}
+	if (Ev->PhaseNs[Phase] == 0)
+	{
+		Ev->PhaseStartNs[Phase] = Start;
+	}
+	Ev->PhaseNs[Phase] += Now - Start;
+}
+
+void recordPause(long long Pause)
+{
+	long long Micros = Pause / 1000;
+	unsigned Bucket = (Micros == 0) ? 0 : 64 - __builtin_clzll(Micros);
+
+	if (Bucket >= NUM_PAUSE_BUCKETS)
+	{
+		Bucket = NUM_PAUSE_BUCKETS - 1;
+	}
+	PauseTimeNs += Pause;
+	MaxPauseNs = (Pause > MaxPauseNs) ? Pause : MaxPauseNs;
+	PauseHistogram[Bucket]++;
+	if (CurEvent != NULL)
+	{
+		CurEvent->PauseNs += Pause;
+	}
+}
+
+static long long getBytesAllocated()
+{
+	long long Allocated = NumBytesAllocated;
+	ThreadCache *TC;
+
+	for (TC = ThreadCaches; TC != NULL; TC = TC->Next)
+	{
+		Allocated += TC->NumBytesAllocated;
+	}
+	return Allocated;
+}
+
+void printMemoryStats()
+{
+	long long Allocated;
+
+	lockHeap();
+	Allocated = getBytesAllocated();
+	unlockHeap();
+
+	printf("Num Bytes Allocated: %lld\n", Allocated);
+	printf("Num Bytes Freed: %lld\n", NumBytesFreed);
+	printf("Num GC Triggered: %lld\n", NumGCTriggered);
+	printf("Num Minor GCs: %lld\n", NumMinorGCs);
+	printf("Num Pages Swept Eagerly: %lld\n", NumPagesSweptEagerly);
+	printf("Num Pages Swept Lazily: %lld\n", NumPagesSweptLazily);
+	printf("Num Pages Swept in Background: %lld\n", NumPagesSweptInBackground);
+	printf("Num Pages Evacuated: %lld\n", NumPagesEvacuated);
+	printf("Num Bytes Moved: %lld\n", NumBytesMoved);
+	printf("Mark Time (ms): %lld\n", MarkTimeNs / 1000000);
+	printf("Pause Time (ms): %lld\n", PauseTimeNs / 1000000);
+	printf("Max Pause Time (ms): %lld\n", MaxPauseNs / 1000000);
+	printf("Num Bytes Decommitted: %lld\n", NumBytesDecommitted);
+	printf("Num Big Runs Reused: %lld\n", NumBigRunsReused);
+}
+
+void getGCStats(GCStats *Stats)
+{
+	unsigned Idx;
+
+	lockHeap();
+	Stats->NumGCs = NumGCTriggered;
+	Stats->NumMinorGCs = NumMinorGCs;
+	Stats->BytesAllocated = getBytesAllocated();
+	Stats->BytesFreed = NumBytesFreed;
+	Stats->BytesDecommitted = __atomic_load_n(&NumBytesDecommitted, __ATOMIC_RELAXED);
+	Stats->PauseTimeNs = PauseTimeNs;
+	Stats->MaxPauseNs = MaxPauseNs;
+	for (Idx = 0; Idx < NUM_GC_PHASES; Idx++)
+	{
+		Stats->PhaseNs[Idx] = __atomic_load_n(&PhaseTotalNs[Idx], __ATOMIC_RELAXED);
+	}
+	Stats->BytesMarked = TotalBytesMarked;
+	Stats->ObjectsMarked = TotalObjectsMarked;
+	Stats->HeapSize = LiveBytes + AllocSinceGC;
+	for (Idx = 0; Idx < NUM_PAUSE_BUCKETS; Idx++)
+	{
+		Stats->PauseHistogram[Idx] = PauseHistogram[Idx];
+	}
+	unlockHeap();
+}
+
+/* copy up to Max of the last collections, oldest first,
+ * and return their number */
+int getGCEvents(GCEvent *Events, int Max)
+{
+	long long First;
+	long long Idx;
+	int Num = 0;
+
+	lockHeap();
+	First = NumGCEvents - Max;
+	if (First < NumGCEvents - MAX_GC_EVENTS)
+	{
+		First = NumGCEvents - MAX_GC_EVENTS;
+	}
+	if (First < 0)
+	{
+		First = 0;
+	}
+	for (Idx = First; Idx < NumGCEvents; Idx++)
+	{
+		Events[Num++] = GCEvents[Idx % MAX_GC_EVENTS];
+	}
+	unlockHeap();
+	return Num;
+}
+
+static const char *GCKindNames[] = { "full", "minor", "concurrent" };
+static const char *GCPhaseNames[NUM_GC_PHASES] = { "sweep", "roots", "mark", "compact", "decommit" };
+static long long TelemetryStartNs = 0;
+
+static FILE* openTelemetryFile(const char *Var)
+{
+	char *Path = getenv(Var);
+	if (Path == NULL || Path[0] == '\0')
+	{
+		return NULL;
+	}
+	FILE *F = fopen(Path, "w");
+	if (F == NULL)
+	{
+		printf("Unable to open %s\n", Path);
+	}
+	return F;
+}
+
+/* summary of the run and of the recorded collections */
+static void writeStatsFile(GCStats *Stats, GCEvent *Events, int NumEvents)
+{
+	FILE *F = openTelemetryFile("SAFEGC_STATS_FILE");
+	double MarkSecs;
+	int Idx;
+	int Phase;
+
+	if (F == NULL)
+	{
+		return;
+	}
+	MarkSecs = Stats->PhaseNs[GC_PHASE_MARK] / 1e9;
+	fprintf(F, "{\n");
+	fprintf(F, "  \"num_gcs\": %lld,\n", Stats->NumGCs);
+	fprintf(F, "  \"num_minor_gcs\": %lld,\n", Stats->NumMinorGCs);
+	fprintf(F, "  \"bytes_allocated\": %lld,\n", Stats->BytesAllocated);
+	fprintf(F, "  \"bytes_freed\": %lld,\n", Stats->BytesFreed);
+	fprintf(F, "  \"bytes_decommitted\": %lld,\n", Stats->BytesDecommitted);
+	fprintf(F, "  \"heap_size\": %lld,\n", Stats->HeapSize);
+	fprintf(F, "  \"pause_time_ns\": %lld,\n", Stats->PauseTimeNs);
+	fprintf(F, "  \"max_pause_ns\": %lld,\n", Stats->MaxPauseNs);
+	fprintf(F, "  \"phase_ns\": {");
+	for (Phase = 0; Phase < NUM_GC_PHASES; Phase++)
+	{
+		fprintf(F, "%s\"%s\": %lld", Phase ? ", " : "", GCPhaseNames[Phase], Stats->PhaseNs[Phase]);
+	}
+	fprintf(F, "},\n");
+	fprintf(F, "  \"bytes_marked\": %lld,\n", Stats->BytesMarked);
+	fprintf(F, "  \"objects_marked\": %lld,\n", Stats->ObjectsMarked);
+	fprintf(F, "  \"mark_rate_mb_per_s\": %.1f,\n",
+		(MarkSecs > 0) ? Stats->BytesMarked / MarkSecs / (1 << 20) : 0.0);
+	fprintf(F, "  \"pause_histogram_us\": [");
+	for (Idx = 0; Idx < NUM_PAUSE_BUCKETS; Idx++)
+	{
+		fprintf(F, "%s{\"below\": %llu, \"count\": %lld}", Idx ? ", " : "",
+			1ULL << Idx, Stats->PauseHistogram[Idx]);
+	}
+	fprintf(F, "],\n");
+	fprintf(F, "  \"gcs\": [");
+	for (Idx = 0; Idx < NumEvents; Idx++)
+	{
+		GCEvent *Ev = &Events[Idx];
+		fprintf(F, "%s\n    {\"kind\": \"%s\", \"start_ns\": %lld, \"duration_ns\": %lld, "
+			"\"pause_ns\": %lld, ", Idx ? "," : "", GCKindNames[Ev->Kind],
+			Ev->StartNs - TelemetryStartNs, Ev->EndNs - Ev->StartNs, Ev->PauseNs);
+		for (Phase = 0; Phase < NUM_GC_PHASES; Phase++)
+		{
+			fprintf(F, "\"%s_ns\": %lld, ", GCPhaseNames[Phase], Ev->PhaseNs[Phase]);
+		}
+		fprintf(F, "\"bytes_marked\": %lld, \"objects_marked\": %lld, "
+			"\"heap_before\": %lld, \"heap_after\": %lld}",
+			Ev->BytesMarked, Ev->ObjectsMarked, Ev->HeapBefore, Ev->HeapAfter);
+	}
+	fprintf(F, "\n  ]\n}\n");
+	fclose(F);
+}
+
+/* Chrome trace-event format: a complete event for each
+ * collection and for each of its phases, in microseconds */
+static void writeTraceFile(GCEvent *Events, int NumEvents)
+{
+	FILE *F = openTelemetryFile("SAFEGC_TRACE_FILE");
+	int First = 1;
+	int Idx;
+	int Phase;
+
+	if (F == NULL)
+	{
+		return;
+	}
+	fprintf(F, "{\"traceEvents\": [");
+	for (Idx = 0; Idx < NumEvents; Idx++)
+	{
+		GCEvent *Ev = &Events[Idx];
+		fprintf(F, "%s\n{\"name\": \"%s GC\", \"cat\": \"gc\", \"ph\": \"X\", "
+			"\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1, "
+			"\"args\": {\"pause_ns\": %lld, \"bytes_marked\": %lld, \"objects_marked\": %lld, "
+			"\"heap_before\": %lld, \"heap_after\": %lld}}",
+			First ? "" : ",", GCKindNames[Ev->Kind], (Ev->StartNs - TelemetryStartNs) / 1e3,
+			(Ev->EndNs - Ev->StartNs) / 1e3, Ev->PauseNs, Ev->BytesMarked,
+			Ev->ObjectsMarked, Ev->HeapBefore, Ev->HeapAfter);
+		First = 0;
+		for (Phase = 0; Phase < NUM_GC_PHASES; Phase++)
+		{
+			if (Ev->PhaseNs[Phase] == 0)
+			{
+				continue;
+			}
+			/* the decommit runs on its own thread */
+			fprintf(F, ",\n{\"name\": \"%s\", \"cat\": \"gc\", \"ph\": \"X\", "
+				"\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+				GCPhaseNames[Phase], (Ev->PhaseStartNs[Phase] - TelemetryStartNs) / 1e3,
+				Ev->PhaseNs[Phase] / 1e3, (Phase == GC_PHASE_DECOMMIT) ? 2 : 1);
+		}
+	}
+	fprintf(F, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+	fclose(F);
+}
+
+static void writeTelemetry()
+{
+	static GCEvent Events[MAX_GC_EVENTS];
+	GCStats Stats;
+	int NumEvents;
+
+	getGCStats(&Stats);
+	NumEvents = getGCEvents(Events, MAX_GC_EVENTS);
+	writeStatsFile(&Stats, Events, NumEvents);
+	writeTraceFile(Events, NumEvents);
+}
+
+/* SAFEGC_STATS_FILE and SAFEGC_TRACE_FILE name the files that
+ * get a JSON summary and a Chrome trace (chrome://tracing or
+ * Perfetto) of the recorded collections at exit */
+void initTelemetry()
+{
+	static int Initialized = 0;
+
+	if (Initialized)
+	{
+		return;
+	}
+	Initialized = 1;
+	TelemetryStartNs = getTimeNs();
+	if (getenv("SAFEGC_STATS_FILE") != NULL || getenv("SAFEGC_TRACE_FILE") != NULL)
+	{
+		atexit(writeTelemetry);
+	}
+}
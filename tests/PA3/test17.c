@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+typedef unsigned long long u64;
+
+struct A
+{
+	u64 a;
+	u64 b;
+	u64 c;
+	u64 d;
+	u64 e;
+};
+
+struct B
+{
+	u64 *a;
+};
+
+/* v1->b sits where an object header would keep the type
+ * of an object at &v1->c, and holds the type of struct B */
+void foo()
+{
+	struct A *v1 = (struct A*)mymalloc(sizeof(struct A));
+	v1->b = 3;
+	struct B *v2 = (struct B*)&v1->c;
+}
+
+int main()
+{
+	foo();
+	return 0;
+}
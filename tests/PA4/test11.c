@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* HeapToStack moves an allocation to the stack only if it has
+ * at most 1024 bytes, isn't in a loop and doesn't escape.
+ * Expected output: stack, heap, heap, heap.
+ */
+
+static GCStats Stats;
+long long *Escaped;
+
+static long long allocated()
+{
+	getGCStats(&Stats);
+	return Stats.BytesAllocated;
+}
+
+long long __attribute__((noinline)) small(int idx)
+{
+	long long *obj = (long long*)mymalloc(1024);
+	obj[idx & 7] = idx + 1;
+	return obj[idx / 2];
+}
+
+long long __attribute__((noinline)) large(int idx)
+{
+	long long *obj = (long long*)mymalloc(1025);
+	obj[idx & 7] = idx + 1;
+	return obj[idx / 2];
+}
+
+long long __attribute__((noinline)) inLoop(int idx)
+{
+	long long sum = 0;
+	int i;
+	for (i = 0; i <= idx; i++) {
+		long long *obj = (long long*)mymalloc(64);
+		obj[i & 7] = i + 1;
+		sum += obj[idx & 7];
+	}
+	return sum;
+}
+
+long long __attribute__((noinline)) escaping(int idx)
+{
+	long long *obj = (long long*)mymalloc(64);
+	obj[idx & 7] = idx + 1;
+	Escaped = obj;
+	return obj[idx / 2];
+}
+
+static void report(const char *name, long long before)
+{
+	printf("%s: %s\n", name, allocated() == before ? "stack" : "heap");
+}
+
+int main(int argc, char *argv[])
+{
+	long long before, sum = 0;
+	if (argc != 2) {
+		printf("usage: <idx>\n");
+		return 0;
+	}
+	int idx = readArgv(argv, 1);
+
+	before = allocated();
+	sum += small(idx);
+	report("1024 bytes", before);
+
+	before = allocated();
+	sum += large(idx);
+	report("1025 bytes", before);
+
+	before = allocated();
+	sum += inLoop(idx);
+	report("in a loop", before);
+
+	before = allocated();
+	sum += escaping(idx);
+	report("escaping", before);
+
+	printf("sum: %lld\n", sum);
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+/* A pointer is copied with memcpy into an object whose type has
+ * no pointers. TypeAssigner must leave the object untyped, so
+ * that the collector scans it and keeps the target alive.
+ * Expected output: target alive.
+ */
+
+typedef unsigned long long u64;
+
+struct Words
+{
+	u64 a;
+	u64 b;
+};
+
+struct Target
+{
+	u64 magic;
+	u64 pad[3];
+};
+
+void *Sink;
+
+struct Words* __attribute__((noinline)) hide(int n)
+{
+	struct Target *t = (struct Target*)mymalloc(sizeof(struct Target));
+	struct Words *w = (struct Words*)mymalloc(sizeof(struct Words));
+	t->magic = 0x5afe6c;
+	w->b = n;
+	memcpy(w, &t, n);
+	return w;
+}
+
+/* overwrite the stale copies of the pointer left on the stack */
+void __attribute__((noinline)) clearStack()
+{
+	volatile char buf[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct Target *t;
+	int i;
+	if (argc != 2) {
+		printf("usage: <size of a pointer>\n");
+		return 0;
+	}
+	int n = readArgv(argv, 1);
+	struct Words *w = hide(n);
+	clearStack();
+	runGC();
+
+	/* a freed target would be handed out again, zeroed */
+	for (i = 0; i < 1000; i++) {
+		Sink = mymalloc(sizeof(struct Target));
+	}
+	memcpy(&t, w, n);
+	printf("%s\n", t->magic == 0x5afe6c ? "target alive" : "target freed");
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* The collector scans only the pointer slots of an object typed
+ * by TypeAssigner, and all of an object it left untyped: here an
+ * address kept in an integer field is ignored in the first case
+ * and keeps its target alive in the second. Expected output:
+ * precise: pointer field kept, integer field freed
+ * conservative: pointer field kept, integer field kept
+ */
+
+typedef unsigned long long u64;
+
+#define MAGIC 0x5afe6c
+
+struct Target
+{
+	u64 magic;
+	u64 pad[3];
+};
+
+struct Rec
+{
+	struct Target *ptr;
+	volatile u64 addr;
+};
+
+void *Sink;
+
+struct Target* __attribute__((noinline)) newTarget()
+{
+	struct Target *t = (struct Target*)mymalloc(sizeof(struct Target));
+	t->magic = MAGIC;
+	return t;
+}
+
+u64 __attribute__((noinline)) addressOf(struct Target *t)
+{
+	return (u64)t;
+}
+
+void __attribute__((noinline)) touch(struct Rec *r)
+{
+	Sink = r;
+}
+
+/* overwrite the stale copies of the targets left on the stack */
+void __attribute__((noinline)) clearStack()
+{
+	volatile char buf[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = 0;
+	}
+}
+
+/* collect, and hand out the memory of the freed targets again */
+void __attribute__((noinline)) collect()
+{
+	int i;
+	clearStack();
+	runGC();
+	for (i = 0; i < 1000; i++) {
+		Sink = mymalloc(sizeof(struct Target));
+	}
+}
+
+static const char *state(struct Target *t)
+{
+	return t->magic == MAGIC ? "kept" : "freed";
+}
+
+void __attribute__((noinline)) precise(int n)
+{
+	struct Rec *r = (struct Rec*)mymalloc(n * sizeof(struct Rec));
+	r->ptr = newTarget();
+	r->addr = addressOf(newTarget());
+	collect();
+	printf("precise: pointer field %s, integer field %s\n",
+		state(r->ptr), state((struct Target*)r->addr));
+}
+
+void __attribute__((noinline)) conservative(int n)
+{
+	struct Rec *r = (struct Rec*)mymalloc(n * sizeof(struct Rec));
+	r->ptr = newTarget();
+	r->addr = addressOf(newTarget());
+	touch(r);
+	collect();
+	printf("conservative: pointer field %s, integer field %s\n",
+		state(r->ptr), state((struct Target*)r->addr));
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		printf("usage: <count>\n");
+		return 0;
+	}
+	int n = readArgv(argv, 1);
+	precise(n);
+	conservative(n);
+	return 0;
+}
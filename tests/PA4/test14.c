@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Compaction moves the sparse pages of leaves that only the
+ * pointer slots of a typed table refer to, and updates those
+ * slots. The leaf whose address the table also keeps in an
+ * integer field must stay where it is. Expected output:
+ * leaves moved: yes
+ * leaves intact: yes
+ * integer field: up to date
+ */
+
+typedef unsigned long long u64;
+
+/* one leaf in SPARSE stays live */
+#define SPARSE 10
+#define KEY 0x5a5a5a5a5a5a5a5aULL
+
+struct Leaf
+{
+	u64 id;
+	u64 check;
+	u64 pad[4];
+};
+
+struct Entry
+{
+	struct Leaf *ptr;
+	volatile u64 addr;
+};
+
+u64 __attribute__((noinline)) addressOf(struct Leaf *l)
+{
+	return (u64)l;
+}
+
+/* overwrite the stale copies of the leaves left on the stack */
+void __attribute__((noinline)) clearStack()
+{
+	volatile char buf[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = 0;
+	}
+}
+
+void __attribute__((noinline)) check(int n)
+{
+	struct Entry *table = (struct Entry*)mymalloc(n * sizeof(struct Entry));
+	/* hidden from the collector, so that nothing gets pinned */
+	u64 *before = (u64*)mymalloc(n * sizeof(u64));
+	int moved = 0, intact = 1;
+	int i;
+
+	for (i = 0; i < n * SPARSE; i++) {
+		struct Leaf *l = (struct Leaf*)mymalloc(sizeof(struct Leaf));
+		l->id = i;
+		l->check = ~(u64)i;
+		if (i % SPARSE == 0) {
+			table[i / SPARSE].ptr = l;
+			before[i / SPARSE] = addressOf(l) ^ KEY;
+		}
+	}
+	table[0].addr = addressOf(table[0].ptr);
+
+	clearStack();
+	runGC();
+
+	for (i = 0; i < n; i++) {
+		struct Leaf *l = table[i].ptr;
+		if (addressOf(l) != (before[i] ^ KEY)) {
+			moved++;
+		}
+		if (l->id != (u64)i * SPARSE || l->check != ~((u64)i * SPARSE)) {
+			intact = 0;
+		}
+	}
+	printf("leaves moved: %s\n", moved ? "yes" : "no");
+	printf("leaves intact: %s\n", intact ? "yes" : "no");
+	printf("integer field: %s\n",
+		table[0].addr == addressOf(table[0].ptr) ? "up to date" : "stale");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		printf("usage: <num live leaves>\n");
+		return 0;
+	}
+	/* compact in every collection, any page at most 90% full */
+	setenv("SAFEGC_COMPACT_INTERVAL", "1", 1);
+	setenv("SAFEGC_COMPACT_OCCUPANCY", "90", 1);
+	check(readArgv(argv, 1));
+	return 0;
+}
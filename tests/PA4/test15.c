@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Generational mode: young nodes are reachable only through old
+ * ones, which the write barriers dirty the cards of. The minor
+ * collections must keep them alive. Expected output:
+ * minor GCs: yes
+ * young nodes intact: yes
+ */
+
+typedef unsigned long long u64;
+
+#define NUM_OLD 1000
+#define GARBAGE_PER_ROUND 20000
+
+struct Node
+{
+	struct Node *next;
+	u64 id;
+	u64 pad[4];
+};
+
+static GCStats Stats;
+void *Sink;
+/* a global root: the optimizer may keep only a derived pointer
+ * outside the table in a register, which the stack scan can't see */
+struct Node **Old;
+
+struct Node* __attribute__((noinline)) newNode(u64 id)
+{
+	struct Node *n = (struct Node*)mymalloc(sizeof(struct Node));
+	n->id = id;
+	return n;
+}
+
+void __attribute__((noinline)) check(int rounds)
+{
+	struct Node **old = (struct Node**)mymalloc(NUM_OLD * sizeof(struct Node*));
+	int intact = 1;
+	int r, i;
+
+	Old = old;
+	for (i = 0; i < NUM_OLD; i++) {
+		old[i] = newNode(i);
+	}
+	/* the nodes are old from now on */
+	runGC();
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < NUM_OLD; i++) {
+			old[i]->next = newNode((u64)r * NUM_OLD + i);
+		}
+		for (i = 0; i < GARBAGE_PER_ROUND; i++) {
+			Sink = newNode(0);
+		}
+		for (i = 0; i < NUM_OLD; i++) {
+			if (old[i]->next->id != (u64)r * NUM_OLD + i) {
+				intact = 0;
+			}
+		}
+	}
+	getGCStats(&Stats);
+	printf("minor GCs: %s\n", Stats.NumMinorGCs > 0 ? "yes" : "no");
+	printf("young nodes intact: %s\n", intact ? "yes" : "no");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		printf("usage: <rounds>\n");
+		return 0;
+	}
+	/* before the first allocation, which reads them */
+	setenv("SAFEGC_GENERATIONAL", "1", 1);
+	setenv("SAFEGC_MIN_HEAP_MB", "2", 1);
+	check(readArgv(argv, 1));
+	return 0;
+}
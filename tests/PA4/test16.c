@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "memory.h"
+
+/* A worker thread only reads a list that it got as its start
+ * argument and never allocates. The collections that run while
+ * it waits must scan its stack and keep the list alive.
+ * Expected output: worker list intact: yes
+ */
+
+typedef unsigned long long u64;
+
+#define NUM_NODES 1000
+#define NUM_ROUNDS 3
+
+struct Node
+{
+	struct Node *next;
+	u64 id;
+	u64 pad[2];
+};
+
+void *Sink;
+volatile int Go = 0;
+int Intact = 0;
+
+void* worker(void *arg)
+{
+	struct Node *n = (struct Node*)arg;
+	u64 i = 0;
+
+	while (!Go) {
+	}
+	for (; n != NULL; n = n->next) {
+		if (n->id != i++) {
+			return NULL;
+		}
+	}
+	Intact = (i == NUM_NODES);
+	return NULL;
+}
+
+void __attribute__((noinline)) start(pthread_t *t)
+{
+	struct Node *list = NULL;
+	int i;
+
+	for (i = NUM_NODES - 1; i >= 0; i--) {
+		struct Node *n = (struct Node*)mymalloc(sizeof(struct Node));
+		n->id = i;
+		n->next = list;
+		list = n;
+	}
+	pthread_create(t, NULL, worker, list);
+}
+
+/* overwrite the stale copies of the list left on the stack */
+void __attribute__((noinline)) clearStack()
+{
+	volatile char buf[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t t;
+	int r, i;
+
+	start(&t);
+	clearStack();
+	/* a freed node would be handed out again and overwritten */
+	for (r = 0; r < NUM_ROUNDS; r++) {
+		runGC();
+		for (i = 0; i < NUM_NODES; i++) {
+			struct Node *n = (struct Node*)mymalloc(sizeof(struct Node));
+			n->id = ~0ULL;
+			Sink = n;
+		}
+	}
+	Go = 1;
+	pthread_join(t, NULL);
+	printf("worker list intact: %s\n", Intact ? "yes" : "no");
+	return 0;
+}
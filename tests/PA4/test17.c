@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+/* The side tables of a segment become writable only for the
+ * data committed in it. A small and a big allocation, which
+ * take a segment each, must not grow the writable memory of
+ * the process by more than a few megabytes.
+ * Expected output: metadata follows the data: yes
+ */
+
+#define LIMIT_KB (64 << 10)
+
+void *Sink;
+
+/* writable private memory of the process, in kB */
+long readVmData()
+{
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (f == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "VmData:", 7) == 0) {
+			kb = atol(line + 7);
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+int main(int argc, char *argv[])
+{
+	long before = readVmData();
+	Sink = mymalloc(64);
+	Sink = mymalloc(1 << 20);
+	long after = readVmData();
+
+	printf("metadata follows the data: %s\n",
+		(before >= 0 && after - before < LIMIT_KB) ? "yes" : "no");
+	return 0;
+}
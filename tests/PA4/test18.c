@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Lazy sweeping: a collection triggered by an allocation leaves
+ * the garbage unswept, and the allocations that follow sweep
+ * it page by page without another collection.
+ * Expected output:
+ * swept at the collection: part
+ * swept by later allocations: yes
+ */
+
+#define OBJ_SIZE 64
+#define BATCH 1000
+
+static GCStats Stats;
+void *Sink;
+
+void allocBatch()
+{
+	int i;
+	for (i = 0; i < BATCH; i++) {
+		Sink = mymalloc(OBJ_SIZE);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long long allocated = 0;
+	long long freedAtGC, gcs;
+
+	/* before the first allocation, which reads it */
+	setenv("SAFEGC_MIN_HEAP_MB", "4", 1);
+	do {
+		Sink = mymalloc(OBJ_SIZE);
+		allocated += OBJ_SIZE;
+		getGCStats(&Stats);
+	} while (Stats.NumGCs == 0);
+	freedAtGC = Stats.BytesFreed;
+	gcs = Stats.NumGCs;
+
+	allocBatch();
+	getGCStats(&Stats);
+	printf("swept at the collection: %s\n", freedAtGC < allocated / 2 ? "part" : "all");
+	printf("swept by later allocations: %s\n",
+		(Stats.NumGCs == gcs && Stats.BytesFreed > freedAtGC) ? "yes" : "no");
+	return 0;
+}
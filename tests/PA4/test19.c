@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Size-class pages: after every other object of a run of pages
+ * dies, new objects of the same size fill the freed slots of
+ * those pages instead of taking new ones.
+ * Expected output:
+ * survivors intact: yes
+ * freed slots reused: yes
+ */
+
+typedef unsigned long long u64;
+
+#define NUM_OBJS 20000
+
+struct Obj
+{
+	u64 id;
+	u64 pad[5];
+};
+
+struct Obj **Table;
+void *Sink;
+
+int main(int argc, char *argv[])
+{
+	u64 lo = ~0ULL, hi = 0;
+	int i, inside = 0, intact = 1;
+
+	Table = (struct Obj**)mymalloc(NUM_OBJS * sizeof(struct Obj*));
+	for (i = 0; i < NUM_OBJS; i++) {
+		struct Obj *o = (struct Obj*)mymalloc(sizeof(struct Obj));
+		u64 addr = (u64)o;
+		o->id = i;
+		Table[i] = o;
+		lo = addr < lo ? addr : lo;
+		hi = addr > hi ? addr : hi;
+	}
+	for (i = 0; i < NUM_OBJS; i += 2) {
+		Table[i] = NULL;
+	}
+	runGC();
+
+	for (i = 0; i < NUM_OBJS / 2; i++) {
+		struct Obj *o = (struct Obj*)mymalloc(sizeof(struct Obj));
+		u64 addr = (u64)o;
+		o->id = ~0ULL;
+		Sink = o;
+		if (addr >= lo && addr <= hi) {
+			inside++;
+		}
+	}
+	for (i = 1; i < NUM_OBJS; i += 2) {
+		if (Table[i]->id != i) {
+			intact = 0;
+		}
+	}
+	printf("survivors intact: %s\n", intact ? "yes" : "no");
+	printf("freed slots reused: %s\n", inside >= NUM_OBJS / 2 * 9 / 10 ? "yes" : "no");
+	return 0;
+}
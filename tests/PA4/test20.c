@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Parallel marking: with four mark threads, a wide tree and a
+ * long list, which the threads can't split, survive repeated
+ * collections, and every one of their objects is marked.
+ * Expected output:
+ * tree intact: yes
+ * list intact: yes
+ * all marked: yes
+ */
+
+typedef unsigned long long u64;
+
+#define TREE_DEPTH 16
+#define TREE_NODES ((1 << TREE_DEPTH) - 1)
+#define LIST_NODES 100000
+#define NUM_ROUNDS 3
+
+struct Tree
+{
+	struct Tree *left;
+	struct Tree *right;
+	u64 id;
+};
+
+struct List
+{
+	struct List *next;
+	u64 id;
+	u64 pad[3];
+};
+
+struct Tree *Root;
+struct List *Head;
+void *Sink;
+static GCEvent Event;
+
+struct Tree* makeTree(int depth, u64 id)
+{
+	struct Tree *t = (struct Tree*)mymalloc(sizeof(struct Tree));
+	t->id = id;
+	t->left = depth > 1 ? makeTree(depth - 1, id * 2) : NULL;
+	t->right = depth > 1 ? makeTree(depth - 1, id * 2 + 1) : NULL;
+	return t;
+}
+
+/* the number of nodes whose id matches their position */
+u64 countTree(struct Tree *t, u64 id)
+{
+	if (t == NULL || t->id != id) {
+		return 0;
+	}
+	return 1 + countTree(t->left, id * 2) + countTree(t->right, id * 2 + 1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct List *l;
+	u64 i;
+	int r;
+
+	/* before the first allocation, which reads it */
+	setenv("SAFEGC_MARK_THREADS", "4", 1);
+	Root = makeTree(TREE_DEPTH, 1);
+	for (i = 0; i < LIST_NODES; i++) {
+		l = (struct List*)mymalloc(sizeof(struct List));
+		l->id = LIST_NODES - 1 - i;
+		l->next = Head;
+		Head = l;
+	}
+	for (r = 0; r < NUM_ROUNDS; r++) {
+		for (i = 0; i < LIST_NODES; i++) {
+			Sink = mymalloc(sizeof(struct List));
+		}
+		runGC();
+	}
+	getGCEvents(&Event, 1);
+
+	for (i = 0, l = Head; l != NULL && l->id == i; l = l->next) {
+		i++;
+	}
+	printf("tree intact: %s\n", countTree(Root, 1) == TREE_NODES ? "yes" : "no");
+	printf("list intact: %s\n", i == LIST_NODES ? "yes" : "no");
+	printf("all marked: %s\n",
+		Event.ObjectsMarked >= TREE_NODES + LIST_NODES ? "yes" : "no");
+	return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "memory.h"
+
+/* Thread-local allocation: four threads build lists while they
+ * allocate garbage that triggers collections. The lists must
+ * survive, and the bytes the threads allocated must be counted
+ * once they exit.
+ * Expected output:
+ * lists intact: yes
+ * allocation counted: yes
+ */
+
+typedef unsigned long long u64;
+
+#define NUM_THREADS 4
+#define LIST_NODES 20000
+#define GARBAGE_PER_NODE 10
+
+struct Node
+{
+	struct Node *next;
+	u64 id;
+	u64 pad[2];
+};
+
+static GCStats Stats;
+void *Sink;
+int Intact[NUM_THREADS];
+
+void* worker(void *arg)
+{
+	u64 idx = (u64)arg;
+	struct Node *head = NULL;
+	u64 i;
+	int j;
+
+	for (i = 0; i < LIST_NODES; i++) {
+		struct Node *n = (struct Node*)mymalloc(sizeof(struct Node));
+		n->id = i;
+		n->next = head;
+		head = n;
+		for (j = 0; j < GARBAGE_PER_NODE; j++) {
+			Sink = mymalloc(sizeof(struct Node));
+		}
+	}
+	for (i = LIST_NODES; head != NULL && head->id == i - 1; head = head->next) {
+		i--;
+	}
+	Intact[idx] = (i == 0);
+	return NULL;
+}
+
+long long allocatedBytes()
+{
+	getGCStats(&Stats);
+	return Stats.BytesAllocated;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t t[NUM_THREADS];
+	long long before, perNode;
+	u64 i;
+	int intact = 1;
+
+	/* before the first allocation, which reads it */
+	setenv("SAFEGC_MIN_HEAP_MB", "4", 1);
+	before = allocatedBytes();
+	for (i = 0; i < GARBAGE_PER_NODE + 1; i++) {
+		Sink = mymalloc(sizeof(struct Node));
+	}
+	perNode = allocatedBytes() - before;
+
+	before = allocatedBytes();
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_create(&t[i], NULL, worker, (void*)i);
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		pthread_join(t[i], NULL);
+		intact = intact && Intact[i];
+	}
+	printf("lists intact: %s\n", intact ? "yes" : "no");
+	printf("allocation counted: %s\n",
+		allocatedBytes() - before == perNode * LIST_NODES * NUM_THREADS ? "yes" : "no");
+	return 0;
+}
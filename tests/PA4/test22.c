@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Root filtering: a global word pointing into the middle of an
+ * object keeps it alive, while words that point into segment
+ * metadata, past the allocated part of a segment, between
+ * segments or outside the heap are ignored without faults.
+ * Expected output:
+ * interior pointer keeps object: yes
+ * garbage freed: yes
+ */
+
+typedef unsigned long long u64;
+
+#define MAGIC 0x5afe6c
+#define KEY 0xa5a5a5a5a5a5a5a5ULL
+#define NUM_FAKE 6
+#define NUM_REFILL 100000
+
+struct Obj
+{
+	u64 magic;
+	u64 pad[5];
+};
+
+u64 Interior;
+u64 Fake[NUM_FAKE];
+void *Sink;
+
+/* returns the address of a dropped object, hidden from the scan */
+u64 __attribute__((noinline)) setup()
+{
+	struct Obj *kept = (struct Obj*)mymalloc(sizeof(struct Obj));
+	struct Obj *dropped = (struct Obj*)mymalloc(sizeof(struct Obj));
+	u64 addr = (u64)kept;
+	u64 segment = addr & ~((1ULL << 34) - 1);
+
+	kept->magic = MAGIC;
+	dropped->magic = MAGIC;
+	Interior = addr + 20;
+	Fake[0] = segment + 64;
+	Fake[1] = addr + (1ULL << 30);
+	Fake[2] = segment + (1ULL << 34) + 8;
+	Fake[3] = (u64)&Fake;
+	Fake[4] = 0x7ffffffff000ULL;
+	Fake[5] = 0xffff800000000000ULL;
+	return (u64)dropped ^ KEY;
+}
+
+/* overwrite the stale copies of the pointers left on the stack */
+void __attribute__((noinline)) clearStack()
+{
+	volatile char buf[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	u64 dropped = setup();
+	int i, reused = 0;
+
+	clearStack();
+	runGC();
+	for (i = 0; i < NUM_REFILL; i++) {
+		struct Obj *o = (struct Obj*)mymalloc(sizeof(struct Obj));
+		u64 addr = (u64)o;
+		o->magic = 0;
+		Sink = o;
+		if ((addr ^ KEY) == dropped) {
+			reused = 1;
+		}
+	}
+	printf("interior pointer keeps object: %s\n",
+		((struct Obj*)(Interior - 20))->magic == MAGIC ? "yes" : "no");
+	printf("garbage freed: %s\n", reused ? "yes" : "no");
+	return 0;
+}
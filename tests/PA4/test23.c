@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Adaptive trigger: a collection starts once the heap has grown
+ * by the growth factor over the bytes found live, so the same
+ * garbage causes far fewer collections with a large live heap
+ * than with a small one.
+ * Expected output:
+ * collections with a small live heap: yes
+ * fewer with a large live heap: yes
+ */
+
+#define MB (1 << 20)
+#define GARBAGE_MB 64
+#define LIVE_CHUNKS 8
+#define CHUNK_MB 4
+#define OBJ_SIZE 64
+
+static GCStats Stats;
+void *Sink;
+void *Live[LIVE_CHUNKS];
+
+long long countGCs()
+{
+	getGCStats(&Stats);
+	return Stats.NumGCs;
+}
+
+/* the collections run while allocating the garbage */
+long long allocGarbage()
+{
+	long long before = countGCs();
+	long long i;
+
+	for (i = 0; i < (long long)GARBAGE_MB * MB / OBJ_SIZE; i++) {
+		Sink = mymalloc(OBJ_SIZE);
+	}
+	return countGCs() - before;
+}
+
+int main(int argc, char *argv[])
+{
+	long long small, large;
+	int i;
+
+	/* before the first allocation, which reads them */
+	setenv("SAFEGC_MIN_HEAP_MB", "4", 1);
+	setenv("SAFEGC_GROWTH_FACTOR", "2", 1);
+	small = allocGarbage();
+
+	for (i = 0; i < LIVE_CHUNKS; i++) {
+		Live[i] = mymalloc(CHUNK_MB * MB);
+	}
+	runGC();
+	large = allocGarbage();
+
+	printf("collections with a small live heap: %s\n", small >= 8 ? "yes" : "no");
+	printf("fewer with a large live heap: %s\n", large * 4 <= small ? "yes" : "no");
+	return 0;
+}
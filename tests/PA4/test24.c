@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+
+/* Batched commit: with SAFEGC_COMMIT_CHUNK_KB=8192 the first
+ * allocation commits a whole 8 MB chunk, and the next 4 MB of
+ * objects are allocated from it without committing more.
+ * Expected output:
+ * first chunk committed: yes
+ * no further commits: yes
+ */
+
+#define CHUNK_KB 8192
+#define OBJ_SIZE 64
+#define NUM_OBJS ((4 << 20) / OBJ_SIZE)
+
+void *Sink;
+
+/* writable private memory of the process, in kB */
+long readVmData()
+{
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (f == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "VmData:", 7) == 0) {
+			kb = atol(line + 7);
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+int main(int argc, char *argv[])
+{
+	long start, first, last;
+	int i;
+
+	/* before the first allocation, which reads it */
+	setenv("SAFEGC_COMMIT_CHUNK_KB", "8192", 1);
+	start = readVmData();
+	Sink = mymalloc(OBJ_SIZE);
+	first = readVmData();
+	for (i = 0; i < NUM_OBJS; i++) {
+		Sink = mymalloc(OBJ_SIZE);
+	}
+	last = readVmData();
+
+	printf("first chunk committed: %s\n",
+		(start >= 0 && first - start >= CHUNK_KB) ? "yes" : "no");
+	printf("no further commits: %s\n", last - first < 1024 ? "yes" : "no");
+	return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "memory.h"
+
+/* Deferred decommit: the pages a collection empties beyond the
+ * 1 MB retention budget are returned to the OS by the release
+ * thread, and new objects take them again before the heap grows.
+ * Expected output:
+ * empty pages decommitted: yes
+ * decommitted pages reused: yes
+ */
+
+typedef unsigned long long u64;
+
+#define MB (1 << 20)
+#define GARBAGE_MB 16
+#define OBJ_SIZE 64
+#define WAIT_MS 5000
+
+static GCStats Stats;
+void *Sink;
+u64 Lo = ~0ULL, Hi = 0;
+
+/* returns the number of objects outside [Lo, Hi] once it is set */
+int allocGarbage(int first)
+{
+	int i, outside = 0;
+
+	for (i = 0; i < GARBAGE_MB * MB / OBJ_SIZE; i++) {
+		void *p = mymalloc(OBJ_SIZE);
+		u64 addr = (u64)p;
+		Sink = p;
+		if (first) {
+			Lo = addr < Lo ? addr : Lo;
+			Hi = addr > Hi ? addr : Hi;
+		} else if (addr < Lo || addr > Hi) {
+			outside++;
+		}
+	}
+	return outside;
+}
+
+int main(int argc, char *argv[])
+{
+	int ms, outside;
+
+	/* before the first allocation, which reads them */
+	setenv("SAFEGC_RETAIN_MB", "1", 1);
+	setenv("SAFEGC_MIN_HEAP_MB", "64", 1);
+	allocGarbage(1);
+	Sink = NULL;
+	runGC();
+	/* the release thread runs after the collection */
+	for (ms = 0; ms < WAIT_MS; ms += 10) {
+		getGCStats(&Stats);
+		if (Stats.BytesDecommitted >= GARBAGE_MB / 2 * MB) {
+			break;
+		}
+		usleep(10000);
+	}
+	outside = allocGarbage(0);
+
+	printf("empty pages decommitted: %s\n",
+		Stats.BytesDecommitted >= GARBAGE_MB / 2 * MB ? "yes" : "no");
+	/* some slack for the pages held by the thread cache */
+	printf("decommitted pages reused: %s\n",
+		outside <= GARBAGE_MB * MB / OBJ_SIZE / 100 ? "yes" : "no");
+	return 0;
+}
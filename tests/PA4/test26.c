@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "memory.h"
+
+/* Background sweeping: with two sweep threads, the garbage left
+ * by a collection is swept while the program sleeps, and the
+ * live objects that share its pages are left intact.
+ * Expected output:
+ * swept in the background: yes
+ * survivors intact: yes
+ */
+
+typedef unsigned long long u64;
+
+#define OBJ_SIZE 64
+#define WAIT_MS 5000
+
+struct Node
+{
+	struct Node *next;
+	u64 id;
+	u64 pad[4];
+};
+
+static GCStats Stats;
+void *Sink;
+struct Node *Head;
+
+int main(int argc, char *argv[])
+{
+	long long allocated = 0, freedAtGC;
+	u64 n = 0, i;
+	int ms;
+
+	/* before the first allocation, which reads them */
+	setenv("SAFEGC_SWEEP_THREADS", "2", 1);
+	setenv("SAFEGC_MIN_HEAP_MB", "4", 1);
+	/* one live node for every nine dead ones */
+	do {
+		struct Node *p = (struct Node*)mymalloc(sizeof(struct Node));
+		if (n % 10 == 0) {
+			p->id = n / 10;
+			p->next = Head;
+			Head = p;
+		} else {
+			Sink = p;
+			allocated += sizeof(struct Node);
+		}
+		n++;
+		getGCStats(&Stats);
+	} while (Stats.NumGCs == 0);
+	freedAtGC = Stats.BytesFreed;
+
+	for (ms = 0; ms < WAIT_MS; ms += 10) {
+		getGCStats(&Stats);
+		if (Stats.BytesFreed - freedAtGC >= allocated / 2) {
+			break;
+		}
+		usleep(10000);
+	}
+	printf("swept in the background: %s\n",
+		Stats.BytesFreed - freedAtGC >= allocated / 2 ? "yes" : "no");
+
+	i = (n - 1) / 10 + 1;
+	for (; Head != NULL && Head->id == i - 1; Head = Head->next) {
+		i--;
+	}
+	printf("survivors intact: %s\n", i == 0 ? "yes" : "no");
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "memory.h"
+
+/* Telemetry: a child process runs three collections, checks
+ * their events and the pause histogram, and writes a Chrome
+ * trace at exit, which the parent reads back.
+ * Expected output:
+ * events recorded: yes
+ * pause histogram: yes
+ * trace written: yes
+ */
+
+#define NUM_GCS 3
+#define OBJ_SIZE 64
+
+static GCStats Stats;
+static GCEvent Events[NUM_GCS + 1];
+void *Sink;
+
+void collectAndCheck()
+{
+	int i, ok = 1;
+	long long paused = 0;
+
+	for (i = 0; i < NUM_GCS; i++) {
+		Sink = mymalloc(OBJ_SIZE);
+		runGC();
+	}
+	if (getGCEvents(Events, NUM_GCS + 1) != NUM_GCS) {
+		ok = 0;
+	}
+	for (i = 0; ok && i < NUM_GCS; i++) {
+		GCEvent *e = &Events[i];
+		long long phases = e->PhaseNs[GC_PHASE_ROOTS] + e->PhaseNs[GC_PHASE_MARK];
+		if (e->Kind != GC_FULL || e->PauseNs <= 0 || e->EndNs <= e->StartNs
+			|| e->PhaseNs[GC_PHASE_MARK] <= 0 || phases > e->EndNs - e->StartNs) {
+			ok = 0;
+		}
+	}
+	printf("events recorded: %s\n", ok ? "yes" : "no");
+
+	getGCStats(&Stats);
+	for (i = 0; i < NUM_PAUSE_BUCKETS; i++) {
+		paused += Stats.PauseHistogram[i];
+	}
+	printf("pause histogram: %s\n", paused == NUM_GCS ? "yes" : "no");
+}
+
+/* the number of times pattern occurs in the file at path */
+int countInFile(const char *path, const char *pattern)
+{
+	char line[1024];
+	int count = 0;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *p = line;
+		while ((p = strstr(p, pattern)) != NULL) {
+			count++;
+			p++;
+		}
+	}
+	fclose(f);
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[64];
+	int status;
+
+	sprintf(path, "/tmp/safegc_trace_%d.json", (int)getpid());
+	/* read by the child on its first allocation */
+	setenv("SAFEGC_TRACE_FILE", path, 1);
+	fflush(stdout);
+	pid_t child = fork();
+	if (child == 0) {
+		collectAndCheck();
+		exit(0);
+	}
+	waitpid(child, &status, 0);
+	printf("trace written: %s\n",
+		countInFile(path, "\"name\": \"full GC\"") == NUM_GCS ? "yes" : "no");
+	unlink(path);
+	return 0;
+}
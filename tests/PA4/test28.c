@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "memory.h"
+
+/* Allocation sampling: with one sample per 4 kB, a site that
+ * allocates 8 MB and one that allocates 800 kB are listed
+ * heaviest first in the profile, with estimated object counts
+ * close to the real ones. The byte estimates include headers.
+ * Expected output:
+ * heavy site estimated: yes
+ * light site estimated: yes
+ */
+
+#define OBJ_SIZE 64
+#define HEAVY_BYTES (8 << 20)
+#define LIGHT_BYTES (HEAVY_BYTES / 10)
+
+void *Sink;
+
+void __attribute__((noinline)) allocHeavy()
+{
+	int i;
+	for (i = 0; i < HEAVY_BYTES / OBJ_SIZE; i++) {
+		Sink = mymalloc(OBJ_SIZE);
+	}
+}
+
+void __attribute__((noinline)) allocLight()
+{
+	int i;
+	for (i = 0; i < LIGHT_BYTES / OBJ_SIZE; i++) {
+		Sink = mymalloc(OBJ_SIZE);
+	}
+}
+
+int within(double estimate, double real, double tolerance)
+{
+	return estimate >= real * (1 - tolerance) && estimate <= real * (1 + tolerance);
+}
+
+int main(int argc, char *argv[])
+{
+	char path[64], line[1024];
+	double objects[2] = { 0, 0 }, bytes;
+	int num = 0;
+
+	/* before the first allocation, which reads it */
+	setenv("SAFEGC_SAMPLE_BYTES", "4096", 1);
+	allocHeavy();
+	allocLight();
+
+	sprintf(path, "/tmp/safegc_profile_%d.txt", (int)getpid());
+	writeAllocProfile(path);
+	FILE *f = fopen(path, "r");
+	while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+		if (num < 2 && sscanf(line, "%lf bytes in %lf objects", &bytes, &objects[num]) == 2) {
+			num++;
+		}
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+	unlink(path);
+
+	printf("heavy site estimated: %s\n", within(objects[0], HEAVY_BYTES / OBJ_SIZE, 0.25) ? "yes" : "no");
+	printf("light site estimated: %s\n", within(objects[1], LIGHT_BYTES / OBJ_SIZE, 0.5) ? "yes" : "no");
+	return 0;
+}
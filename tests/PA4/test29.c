@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "memory.h"
+
+/* Big-object runs: the pages of dead big objects are reused
+ * best-fit, and adjacent runs are merged, before the segment
+ * grows. Two 16-page objects next to each other, a 4-page and a
+ * 3-page one die; a 3-page object takes the 3-page hole and a
+ * 32-page object the merged run.
+ * Expected output:
+ * best fit: yes
+ * adjacent runs merged: yes
+ */
+
+typedef unsigned long long u64;
+
+#define PAGE 4096
+#define HEADER 16
+#define KEY 0xa5a5a5a5a5a5a5a5ULL
+#define WAIT_MS 5000
+
+static GCStats Stats;
+void *Keep[3];
+
+/* a big object that takes exactly the given number of pages */
+void* allocPages(int pages)
+{
+	return mymalloc(pages * PAGE - HEADER);
+}
+
+/* returns the hidden addresses of the two holes */
+void __attribute__((noinline)) setup(u64 *merged, u64 *small)
+{
+	void *a = allocPages(16);
+	void *b = allocPages(16);
+	Keep[0] = allocPages(2);
+	void *c = allocPages(4);
+	Keep[1] = allocPages(2);
+	void *d = allocPages(3);
+	Keep[2] = allocPages(2);
+
+	*merged = (u64)a ^ KEY;
+	*small = (u64)d ^ KEY;
+	/* the objects must be laid out in order */
+	if ((u64)b != (u64)a + 16 * PAGE || (u64)d != (u64)c + 6 * PAGE) {
+		*merged = *small = 0;
+	}
+}
+
+/* overwrite the stale copies of the pointers left on the stack */
+void __attribute__((noinline)) clearStack()
+{
+	volatile char buf[4096];
+	int i;
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = 0;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	u64 merged, small;
+	int ms;
+
+	setup(&merged, &small);
+	clearStack();
+	runGC();
+	/* the runs are reusable once the release thread has run */
+	for (ms = 0; ms < WAIT_MS; ms += 10) {
+		getGCStats(&Stats);
+		if (Stats.BytesDecommitted >= 39 * PAGE) {
+			break;
+		}
+		usleep(10000);
+	}
+	u64 three = (u64)allocPages(3) ^ KEY;
+	u64 big = (u64)allocPages(32) ^ KEY;
+
+	printf("best fit: %s\n", small != 0 && three == small ? "yes" : "no");
+	printf("adjacent runs merged: %s\n", merged != 0 && big == merged ? "yes" : "no");
+	return 0;
+}
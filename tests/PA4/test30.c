@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+/* Headerless objects: a 16-byte object takes 16 bytes of the
+ * heap, with its size kept by its page, and the pointers stored
+ * in such objects keep their targets alive through collections
+ * that free the garbage in between.
+ * Expected output:
+ * small objects without headers: yes
+ * contents intact: yes
+ */
+
+typedef unsigned long long u64;
+
+#define NUM_NODES 100000
+#define NUM_GCS 3
+
+struct Node
+{
+	struct Node *next;
+	u64 id;
+};
+
+static GCStats Stats;
+void *Sink;
+struct Node *Head;
+
+int main(int argc, char *argv[])
+{
+	long long before;
+	u64 i;
+	int ok;
+
+	Sink = mymalloc(sizeof(struct Node));
+	getGCStats(&Stats);
+	before = Stats.BytesAllocated;
+	for (i = 0; i < NUM_NODES; i++) {
+		struct Node *p = (struct Node*)mymalloc(sizeof(struct Node));
+		p->id = i;
+		p->next = Head;
+		Head = p;
+		/* a dead node between every two live ones */
+		Sink = mymalloc(sizeof(struct Node));
+	}
+	getGCStats(&Stats);
+	ok = Stats.BytesAllocated - before == 2LL * NUM_NODES * sizeof(struct Node)
+		&& GetSize(Head) == sizeof(struct Node);
+	printf("small objects without headers: %s\n", ok ? "yes" : "no");
+
+	for (i = 0; i < NUM_GCS; i++) {
+		runGC();
+		/* the freed slots are taken again */
+		Sink = mymalloc(sizeof(struct Node));
+	}
+	i = NUM_NODES;
+	for (; Head != NULL && Head->id == i - 1; Head = Head->next) {
+		i--;
+	}
+	printf("contents intact: %s\n", i == 0 ? "yes" : "no");
+	return 0;
+}